@@ -1,6 +1,7 @@
 #pragma once
 
 #include <vector>
+#include <algorithm>
 using namespace std;
 
 template<typename TKey, typename TVal>
@@ -24,10 +25,10 @@ public:
 
     void add(const TKey& k, const TVal& v)
     {
-        _vec.emplace_back(k, v);
-        std::sort(_vec.begin(), _vec.end(), [](const auto& lhs, const auto& rhs) {
-            return lhs.first < rhs.first;
+        auto it = std::lower_bound(_vec.begin(), _vec.end(), k, [](const auto& lhs, const TKey& rhs) {
+            return lhs.first < rhs;
         });
+        _vec.emplace(it, k, v);
     }
 
     bool has(const TKey& key) const
@@ -58,6 +59,11 @@ public:
         throw std::exception();
     }
 
+    const TVal& get(const TKey& key) const
+    {
+        return const_cast<CompactMap*>(this)->get(key);
+    }
+
     auto begin()
     {
         return _vec.begin();
@@ -68,6 +74,16 @@ public:
         return _vec.end();
     }
 
+    auto begin() const
+    {
+        return _vec.begin();
+    }
+
+    auto end() const
+    {
+        return _vec.end();
+    }
+
 private:
     vector<pair<TKey, TVal>> _vec;
 };
@@ -1,7 +1,17 @@
 #pragma once
 
 #include <bitset>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
 using std::bitset;
+using std::vector;
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include "jobs.hpp"
 
 // simple matrix class with row-major storage
 // fast, no bounds checking
@@ -59,16 +69,17 @@ public:
             out.getWidth() < _width * factor)
             return;
 
-#pragma omp parallel for
-        for (int y = 0; y < static_cast<int>(_height); y++) {
-            for (size_t x = 0; x < _width; x++) {
-                for (size_t oy = 0; oy < factor; oy++) {
-                    for (size_t ox = 0; ox < factor; ox++) {
-                        out(x*factor + ox, y*factor + oy) = (*this)(x, y);
+        JOBS->parallelFor(0, _height, 16, [&](size_t begin, size_t end) {
+            for (size_t y = begin; y < end; y++) {
+                for (size_t x = 0; x < _width; x++) {
+                    for (size_t oy = 0; oy < factor; oy++) {
+                        for (size_t ox = 0; ox < factor; ox++) {
+                            out(x*factor + ox, y*factor + oy) = (*this)(x, y);
+                        }
                     }
                 }
             }
-        }
+        });
 
     }
 
@@ -83,114 +94,341 @@ private:
     uint32_t _height;
 };
 
+inline uint32_t popcount64(uint64_t v)
+{
+#ifdef _MSC_VER
+    return static_cast<uint32_t>(__popcnt64(v));
+#else
+    return static_cast<uint32_t>(__builtin_popcountll(v));
+#endif
+}
+
+// index of the lowest set bit; v must be nonzero
+inline uint32_t ctz64(uint64_t v)
+{
+#ifdef _MSC_VER
+    unsigned long idx;
+    _BitScanForward64(&idx, v);
+    return idx;
+#else
+    return static_cast<uint32_t>(__builtin_ctzll(v));
+#endif
+}
+
+// Two-level sparse bitmap. Cells are grouped into 8x8 tiles of one 64-bit
+// word each. A summary bitmap records which tiles have any bit set, and
+// only those tiles are stored, packed in tile order; a tile's slot is the
+// number of nonempty tiles before it.
+
 template<uint32_t width, uint32_t height>
-class BitsetMatrix
+class SparseMatrixBool
 {
 public:
-    BitsetMatrix()
+    static const uint32_t TILE = 8;
+    static const uint32_t tilesX = (width + TILE - 1) / TILE;
+    static const uint32_t tilesY = (height + TILE - 1) / TILE;
+    static const uint32_t numTiles = tilesX * tilesY;
+    static const uint32_t summaryWords = (numTiles + 63) / 64;
+
+    SparseMatrixBool()
     {
-        _data.reset();
+        clear();
     }
 
-    inline void set(uint32_t x, uint32_t y, bool val)
+    void clear()
     {
-        _data[y*width + x] = val;
+        _words.clear();
+        for (uint32_t i = 0; i < summaryWords; ++i) {
+            _any[i] = 0;
+            _rankBase[i] = 0;
+        }
     }
 
     inline bool operator()(uint32_t x, uint32_t y) const
     {
-        return _data[y*width + x];
+        return (tileBits(x / TILE, y / TILE) >> bitIndex(x, y)) & 1;
+    }
+
+    inline void set(uint32_t x, uint32_t y, bool val)
+    {
+        uint32_t tx = x / TILE;
+        uint32_t ty = y / TILE;
+        uint64_t bit = uint64_t(1) << bitIndex(x, y);
+        uint64_t bits = tileBits(tx, ty);
+        setTile(tx, ty, val ? (bits | bit) : (bits & ~bit));
+    }
+
+    // all 64 cells of a tile at once; bit (y % 8) * 8 + (x % 8)
+    uint64_t tileBits(uint32_t tx, uint32_t ty) const
+    {
+        uint32_t t = ty * tilesX + tx;
+        if (!testSummary(_any, t))
+            return 0;
+        return _words[rank(t)];
+    }
+
+    void setTile(uint32_t tx, uint32_t ty, uint64_t bits)
+    {
+        uint32_t t = ty * tilesX + tx;
+        bits &= validMask(tx, ty);
+        bool stored = testSummary(_any, t);
+
+        if (bits == 0) {
+            if (stored)
+                eraseTile(t);
+        }
+        else if (!stored) {
+            insertTile(t, bits);
+        }
+        else {
+            _words[rank(t)] = bits;
+        }
+    }
+
+    size_t memoryUsage() const
+    {
+        return sizeof(*this) + _words.capacity() * sizeof(uint64_t);
+    }
+
+    // calls fn(tx, ty, bits) for each tile with any bit set, in tile order
+    template<typename Fn>
+    void forEachSetTile(Fn fn) const
+    {
+        size_t slot = 0;
+        for (uint32_t i = 0; i < summaryWords; ++i)
+        {
+            for (uint64_t any = _any[i]; any; any &= any - 1)
+            {
+                uint32_t t = i * 64 + ctz64(any);
+                fn(t % tilesX, t / tilesX, _words[slot++]);
+            }
+        }
     }
 
 private:
-    bitset<width * height> _data;
+    static uint32_t bitIndex(uint32_t x, uint32_t y)
+    {
+        return (y % TILE) * TILE + (x % TILE);
+    }
+
+    static bool testSummary(const uint64_t* summary, uint32_t t)
+    {
+        return (summary[t / 64] >> (t % 64)) & 1;
+    }
+
+    static void setSummary(uint64_t* summary, uint32_t t, bool val)
+    {
+        if (val)
+            summary[t / 64] |= uint64_t(1) << (t % 64);
+        else
+            summary[t / 64] &= ~(uint64_t(1) << (t % 64));
+    }
+
+    // bits of cells in [cx0, cx1) x [cy0, cy1), in tile-local coordinates
+    static uint64_t regionMask(uint32_t cx0, uint32_t cy0, uint32_t cx1, uint32_t cy1)
+    {
+        uint64_t row = ((uint64_t(1) << (cx1 - cx0)) - 1) << cx0;
+        uint64_t mask = 0;
+        for (uint32_t y = cy0; y < cy1; ++y)
+            mask |= row << (y * TILE);
+        return mask;
+    }
+
+    // cells of the tile that lie inside the matrix (edge tiles are partial)
+    static uint64_t validMask(uint32_t tx, uint32_t ty)
+    {
+        uint32_t cx1 = std::min(TILE, width - tx * TILE);
+        uint32_t cy1 = std::min(TILE, height - ty * TILE);
+        if (cx1 == TILE && cy1 == TILE)
+            return ~uint64_t(0);
+        return regionMask(0, 0, cx1, cy1);
+    }
+
+    uint32_t rank(uint32_t t) const
+    {
+        uint64_t below = (uint64_t(1) << (t % 64)) - 1;
+        return _rankBase[t / 64] + popcount64(_any[t / 64] & below);
+    }
+
+    void insertTile(uint32_t t, uint64_t bits)
+    {
+        _words.insert(_words.begin() + rank(t), bits);
+        setSummary(_any, t, true);
+        for (uint32_t i = t / 64 + 1; i < summaryWords; ++i)
+            _rankBase[i]++;
+    }
+
+    void eraseTile(uint32_t t)
+    {
+        _words.erase(_words.begin() + rank(t));
+        setSummary(_any, t, false);
+        for (uint32_t i = t / 64 + 1; i < summaryWords; ++i)
+            _rankBase[i]--;
+    }
+
+    uint64_t _any[summaryWords];
+    uint16_t _rankBase[summaryWords]; // nonempty tiles before each summary word
+    vector<uint64_t> _words;
 };
 
+// Run-length encoded matrix, for data that is mostly uniform. Runs are
+// stored in row-major order as parallel arrays of values and cumulative
+// end positions, so random access is a binary search over the run ends.
+// set() splits a run and merges it with equal neighbours, so the run count
+// stays minimal.
+
 template<typename T>
 class RLEMatrix
 {
 public:
-    RLEMatrix(uint32_t x, uint32_t y)
+    RLEMatrix()
     {
-        init(x, y);
+        _width = 0;
+        _height = 0;
+    }
+
+    RLEMatrix(uint32_t x, uint32_t y, T val=T())
+    {
+        init(x, y, val);
     }
 
     void init(uint32_t x, uint32_t y, T val=T())
     {
         _width = x;
         _height = y;
-
-        uint32_t zeroes = _width * _height;
-        while (zeroes > 0)
-        {
-            if (zeroes > 65535) {
-                _data.emplace_back(val, 65535);
-                zeroes -= 65535;
-            }
-            else {
-                _data.emplace_back(val, zeroes);
-                zeroes = 0;
-            }
-        }
+        fill(val);
     }
 
     void fill(T val)
     {
-        _data.clear();
-        init(_width, _height, val);
+        _values.assign(1, val);
+        _ends.assign(1, _width * _height);
     }
 
-    inline void set(uint32_t x, uint32_t y, T val)
+    inline T operator()(uint32_t x, uint32_t y) const
+    {
+        return _values[findRun(y * _width + x)];
+    }
+
+    void set(uint32_t x, uint32_t y, T val)
     {
         uint32_t pos = y * _width + x;
-        
-        for (size_t idx = 0; idx < _data.size(); ++idx)
+        size_t r = findRun(pos);
+        if (_values[r] == val)
+            return;
+
+        uint32_t start = r > 0 ? _ends[r - 1] : 0;
+        uint32_t end = _ends[r];
+
+        bool mergePrev = pos == start && r > 0 && _values[r - 1] == val;
+        bool mergeNext = pos == end - 1 && r + 1 < _values.size() && _values[r + 1] == val;
+
+        if (end - start == 1)
         {
-            pair<T, uint16_t> next = _data[idx];
-            vector<pair<T, uint16_t>> newNodes;
-            newNodes.reserve(3);
-            if (next.second >= pos)
-            {
-                // split and insert
-                _data.erase(_data.begin() + idx);
-                if (pos > 0) {
-                    newNodes.emplace_back(next.first, pos - 1);
-                }
-                newNodes.emplace_back(val, 1);
-                if (pos < next.second) {
-                    if (pos == 0)
-                        newNodes.emplace_back(next.first, next.second - pos - 1);
-                    else
-                        newNodes.emplace_back(next.first, next.second - pos);
-                }
-                _data.insert(_data.begin() + idx, newNodes.begin(), newNodes.end());
-                // TODO: recompress on either side
-                //for (auto& p : _data) {
-                //    cout << p.first << ", " << p.second << endl;
-                //}
-                //cout << endl;
-
-                return;
+            // the whole run changes value
+            if (mergePrev && mergeNext) {
+                _ends[r - 1] = _ends[r + 1];
+                erase(r, 2);
+            }
+            else if (mergePrev) {
+                _ends[r - 1] = end;
+                erase(r, 1);
+            }
+            else if (mergeNext) {
+                erase(r, 1);
             }
-            pos -= next.second;
+            else {
+                _values[r] = val;
+            }
+        }
+        else if (pos == start)
+        {
+            if (mergePrev)
+                _ends[r - 1]++;
+            else
+                insert(r, val, pos + 1);
+        }
+        else if (pos == end - 1)
+        {
+            if (mergeNext)
+                _ends[r]--;
+            else {
+                _ends[r]--;
+                insert(r + 1, val, end);
+            }
+        }
+        else
+        {
+            // split into three
+            T old = _values[r];
+            _ends[r] = pos;
+            insert(r + 1, val, pos + 1);
+            insert(r + 2, old, end);
         }
     }
 
-    inline T operator()(uint32_t x, uint32_t y) const
+    // calls fn(x0, x1, val) for each run covering [x0, x1) of row y
+    template<typename Fn>
+    void forEachRun(uint32_t y, Fn fn) const
     {
-        uint32_t pos = y * _width + x;
-        for (auto& p : _data)
+        uint32_t rowStart = y * _width;
+        uint32_t rowEnd = rowStart + _width;
+        for (size_t r = findRun(rowStart); r < _values.size(); ++r)
         {
-            if (p.second >= pos)
-            {
-                return p.first;
-            }
-            pos -= p.second;
+            uint32_t start = std::max(r > 0 ? _ends[r - 1] : 0, rowStart);
+            uint32_t end = std::min(_ends[r], rowEnd);
+            fn(start - rowStart, end - rowStart, _values[r]);
+            if (_ends[r] >= rowEnd)
+                break;
         }
     }
 
+    size_t numRuns() const
+    {
+        return _values.size();
+    }
+
+    size_t memoryUsage() const
+    {
+        return sizeof(*this) + _values.capacity() * sizeof(T) + _ends.capacity() * sizeof(uint32_t);
+    }
+
+    uint32_t getWidth() const { return _width; }
+    uint32_t getHeight() const { return _height; }
+
+    // raw runs, for serialization: value of each run and its end position
+    const vector<T>& getValues() const { return _values; }
+    const vector<uint32_t>& getEnds() const { return _ends; }
+
+    void assign(uint32_t x, uint32_t y, vector<T> values, vector<uint32_t> ends)
+    {
+        _width = x;
+        _height = y;
+        _values = std::move(values);
+        _ends = std::move(ends);
+    }
+
 private:
+    // index of the run containing pos: the first run ending after it
+    size_t findRun(uint32_t pos) const
+    {
+        return std::upper_bound(_ends.begin(), _ends.end(), pos) - _ends.begin();
+    }
+
+    void insert(size_t r, T val, uint32_t end)
+    {
+        _values.insert(_values.begin() + r, val);
+        _ends.insert(_ends.begin() + r, end);
+    }
+
+    void erase(size_t r, size_t n)
+    {
+        _values.erase(_values.begin() + r, _values.begin() + r + n);
+        _ends.erase(_ends.begin() + r, _ends.begin() + r + n);
+    }
+
     uint32_t _width;
     uint32_t _height;
-    vector<pair<T, uint16_t>> _data;
+    vector<T> _values;
+    vector<uint32_t> _ends;
 };
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+using std::vector;
+
+// Multimap from cell index to the handles in that cell, using open
+// addressing with linear probing. Most cells hold zero or one entity, so a
+// lookup is usually a single probe and never allocates.
+
+template<typename THandle>
+class OccupancyMap
+{
+public:
+    OccupancyMap()
+    {
+        _count = 0;
+    }
+
+    void insert(uint32_t cell, const THandle& h)
+    {
+        if ((_count + 1) * 2 > _slots.size())
+            rehash(_slots.empty() ? 16 : _slots.size() * 2);
+
+        size_t i = home(cell);
+        while (_slots[i].key != EMPTY)
+            i = (i + 1) & _mask;
+        _slots[i].key = cell;
+        _slots[i].handle = h;
+        _count++;
+    }
+
+    void remove(uint32_t cell, const THandle& h)
+    {
+        if (_slots.empty())
+            return;
+
+        size_t i = home(cell);
+        while (_slots[i].key != EMPTY)
+        {
+            if (_slots[i].key == cell && _slots[i].handle == h) {
+                erase(i);
+                return;
+            }
+            i = (i + 1) & _mask;
+        }
+    }
+
+    // calls fn(handle) for each handle in cell
+    template<typename Fn>
+    void forEach(uint32_t cell, Fn fn) const
+    {
+        if (_slots.empty())
+            return;
+
+        for (size_t i = home(cell); _slots[i].key != EMPTY; i = (i + 1) & _mask)
+        {
+            if (_slots[i].key == cell)
+                fn(_slots[i].handle);
+        }
+    }
+
+    bool has(uint32_t cell) const
+    {
+        if (_slots.empty())
+            return false;
+
+        for (size_t i = home(cell); _slots[i].key != EMPTY; i = (i + 1) & _mask)
+        {
+            if (_slots[i].key == cell)
+                return true;
+        }
+        return false;
+    }
+
+    size_t size() const
+    {
+        return _count;
+    }
+
+    // room for n more handles without rehashing
+    void reserve(size_t n)
+    {
+        size_t capacity = _slots.empty() ? 16 : _slots.size();
+        while ((_count + n) * 2 > capacity)
+            capacity *= 2;
+        if (capacity != _slots.size())
+            rehash(capacity);
+    }
+
+    void clear()
+    {
+        _slots.clear();
+        _count = 0;
+        _mask = 0;
+        _shift = 32;
+    }
+
+private:
+    static const uint32_t EMPTY = 0xFFFFFFFF;
+
+    struct Slot
+    {
+        uint32_t key = EMPTY;
+        THandle handle;
+    };
+
+    size_t home(uint32_t cell) const
+    {
+        // Fibonacci hashing; the high bits of the product are the well-mixed ones
+        return static_cast<uint32_t>(cell * 2654435761u) >> _shift;
+    }
+
+    // backward-shift deletion, so probe chains never contain holes
+    void erase(size_t i)
+    {
+        size_t j = i;
+        for (;;)
+        {
+            j = (j + 1) & _mask;
+            if (_slots[j].key == EMPTY)
+                break;
+
+            size_t k = home(_slots[j].key);
+            bool movable = (j > i) ? (k <= i || k > j) : (k <= i && k > j);
+            if (movable) {
+                _slots[i] = _slots[j];
+                i = j;
+            }
+        }
+        _slots[i].key = EMPTY;
+        _count--;
+    }
+
+    void rehash(size_t capacity)
+    {
+        vector<Slot> old;
+        old.swap(_slots);
+        _slots.resize(capacity);
+        _mask = capacity - 1;
+        _shift = 32;
+        while ((size_t(1) << (32 - _shift)) < capacity)
+            _shift--;
+        _count = 0;
+        for (const Slot& s : old)
+        {
+            if (s.key != EMPTY)
+                insert(s.key, s.handle);
+        }
+    }
+
+    vector<Slot> _slots;
+    size_t _count;
+    size_t _mask = 0;
+    uint32_t _shift = 32;
+};
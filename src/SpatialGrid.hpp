@@ -0,0 +1,103 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+using std::vector;
+
+// Uniform grid of buckets over one size x size chunk. Entries carry their
+// world position, so queries can measure distances without looking up
+// components. Takes world coordinates; the local cell is derived from them.
+
+template<typename THandle, uint32_t size, uint32_t cellSize>
+class SpatialGrid
+{
+public:
+    struct Entry
+    {
+        THandle handle;
+        int32_t x;
+        int32_t y;
+    };
+
+    static const uint32_t cells = (size + cellSize - 1) / cellSize;
+
+    void insert(const THandle& h, int x, int y)
+    {
+        bucket(x, y).push_back(Entry{ h, x, y });
+    }
+
+    // Inserts count entries at once, growing each bucket just the once.
+    void insert(const Entry* entries, size_t count)
+    {
+        uint32_t added[cells * cells] = {};
+        for (size_t i = 0; i < count; ++i)
+            added[index(entries[i].x, entries[i].y)]++;
+        for (uint32_t c = 0; c < cells * cells; ++c) {
+            if (added[c])
+                _cells[c].reserve(_cells[c].size() + added[c]);
+        }
+        for (size_t i = 0; i < count; ++i)
+            _cells[index(entries[i].x, entries[i].y)].push_back(entries[i]);
+    }
+
+    void remove(const THandle& h, int x, int y)
+    {
+        vector<Entry>& b = bucket(x, y);
+        for (size_t i = 0; i < b.size(); ++i)
+        {
+            if (b[i].handle == h) {
+                b[i] = b.back();
+                b.pop_back();
+                return;
+            }
+        }
+    }
+
+    // both positions must be inside this chunk
+    void move(const THandle& h, int ox, int oy, int nx, int ny)
+    {
+        vector<Entry>& from = bucket(ox, oy);
+        vector<Entry>& to = bucket(nx, ny);
+        if (&from != &to) {
+            remove(h, ox, oy);
+            insert(h, nx, ny);
+            return;
+        }
+
+        for (Entry& e : from)
+        {
+            if (e.handle == h) {
+                e.x = nx;
+                e.y = ny;
+                return;
+            }
+        }
+    }
+
+    // cx, cy are cell coordinates within the chunk
+    const vector<Entry>& cell(uint32_t cx, uint32_t cy) const
+    {
+        return _cells[cy * cells + cx];
+    }
+
+    void clear()
+    {
+        for (auto& b : _cells)
+            b.clear();
+    }
+
+private:
+    static uint32_t index(int x, int y)
+    {
+        uint32_t cx = (x % size) / cellSize;
+        uint32_t cy = (y % size) / cellSize;
+        return cy * cells + cx;
+    }
+
+    vector<Entry>& bucket(int x, int y)
+    {
+        return _cells[index(x, y)];
+    }
+
+    vector<Entry> _cells[cells * cells];
+};
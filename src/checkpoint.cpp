@@ -0,0 +1,101 @@
+#include "common.hpp"
+#include "wsim.hpp"
+
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+bool Game::checkpoint(const string& path)
+{
+    if (isCheckpointing()) {
+        pollCheckpoint(false);
+        if (isCheckpointing()) {
+            _checkpointStats.skipped++;
+            return false;
+        }
+    }
+
+    auto t0 = high_resolution_clock::now();
+    _checkpointStart = t0;
+    _checkpointStats.started++;
+
+#ifdef _WIN32
+    try
+    {
+        _world->saveSnapshot(path);
+        _checkpointStats.written++;
+    }
+    catch (std::exception&)
+    {
+        _checkpointStats.failed++;
+    }
+    _checkpointStats.forkSeconds = 0;
+    _checkpointStats.writeSeconds = duration_cast<duration<double>>(high_resolution_clock::now() - t0).count();
+    return true;
+#else
+    _world->prepareForFork();
+
+    // The child only has this thread, and a frozen copy of everything as
+    // of this tick boundary. It writes to a temporary file and renames it,
+    // so path always holds a complete snapshot.
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        int rv = 0;
+        try
+        {
+            string tmp = path + ".tmp";
+            _world->reopenPageFile();
+            _world->saveSnapshot(tmp);
+            if (rename(tmp.c_str(), path.c_str()) != 0)
+                rv = 1;
+        }
+        catch (std::exception&)
+        {
+            rv = 1;
+        }
+        // skip destructors and atexit handlers; they belong to the parent
+        _exit(rv);
+    }
+
+    _checkpointStats.forkSeconds = duration_cast<duration<double>>(high_resolution_clock::now() - t0).count();
+    if (pid < 0) {
+        _checkpointStats.failed++;
+        return false;
+    }
+    _checkpointPid = pid;
+    return true;
+#endif
+}
+
+void Game::waitForCheckpoint()
+{
+    if (isCheckpointing())
+        pollCheckpoint(true);
+}
+
+void Game::setAutoCheckpoint(const string& path, uint64_t interval)
+{
+    _checkpointPath = path;
+    _checkpointInterval = interval;
+}
+
+// reap the checkpoint child if it's done, or wait for it if block is set
+void Game::pollCheckpoint(bool block)
+{
+#ifndef _WIN32
+    int status = 0;
+    pid_t pid = waitpid(static_cast<pid_t>(_checkpointPid), &status, block ? 0 : WNOHANG);
+    if (pid == 0)
+        return;
+
+    if (pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        _checkpointStats.written++;
+    else
+        _checkpointStats.failed++;
+    _checkpointStats.writeSeconds = duration_cast<duration<double>>(high_resolution_clock::now() - _checkpointStart).count();
+    _checkpointPid = 0;
+#endif
+}
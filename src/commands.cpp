@@ -0,0 +1,109 @@
+#include "common.hpp"
+#include "wsim.hpp"
+
+// Reads the components of an Add or Create command onto h.
+static void readComponents(Entity* e, const char* in)
+{
+    uint32_t count;
+    readBytes(in, count);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        ComponentId id;
+        readBytes(in, id);
+        CMT->get(id)->readComponent(e->handle, in, false);
+        e->components |= componentBit(id);
+        EM->markChanged();
+    }
+}
+
+// Plays back every worker's commands, then empties the buffers. Only call
+// between ticks.
+void World::applyCommands()
+{
+    typedef pair<const CommandBuffer*, const CommandBuffer::Command*> Entry;
+    vector<Entry> entries;
+    for (const CommandBuffer& buffer : _commandBuffers) {
+        for (const CommandBuffer::Command& cmd : buffer._commands)
+            entries.emplace_back(&buffer, &cmd);
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b)
+    {
+        const CommandBuffer::Command& l = *a.second;
+        const CommandBuffer::Command& r = *b.second;
+        if (l.target.raw != r.target.raw)
+            return l.target.raw < r.target.raw;
+        if (l.kind != r.kind)
+            return l.kind < r.kind;
+        if (l.component != r.component)
+            return l.component < r.component;
+        if (l.x != r.x)
+            return l.x < r.x;
+        if (l.y != r.y)
+            return l.y < r.y;
+        if (l.size != r.size)
+            return l.size < r.size;
+        return memcmp(a.first->_data.data() + l.offset, b.first->_data.data() + r.offset, l.size) < 0;
+    });
+
+    for (const Entry& entry : entries)
+    {
+        const CommandBuffer::Command& cmd = *entry.second;
+        const char* data = entry.first->_data.data() + cmd.offset;
+
+        if (cmd.kind == CommandBuffer::Kind::Create)
+        {
+            Entity* e = EM->makeEntity();
+            e->addComponent<PositionData>()->pos = Position{ cmd.x, cmd.y, 0 };
+            readComponents(e, data);
+            addEntity(e);
+            continue;
+        }
+
+        if (cmd.kind == CommandBuffer::Kind::Destroy)
+        {
+            // it may have been queued twice
+            if (EM->getEntity(cmd.target)->handle != cmd.target)
+                continue;
+            removeEntity(cmd.target);
+            EM->destroyEntity(cmd.target);
+            continue;
+        }
+
+        if (!EM->isValid(cmd.target))
+            continue;
+
+        // an entity in the world always owns its position (commands can't
+        // remove it), unless its components are in a page until
+        // restoreComponents()
+        Entity* e = EM->getEntity(cmd.target);
+        if (!e->hasComponent<PositionData>() && cmd.kind != CommandBuffer::Kind::Move)
+            continue;
+        switch (cmd.kind)
+        {
+        case CommandBuffer::Kind::Add:
+            readComponents(e, data);
+            break;
+        case CommandBuffer::Kind::Remove:
+            e->components &= ~componentBit(cmd.component);
+            EM->markChanged();
+            CMT->get(cmd.component)->destroyComponent(cmd.target);
+            break;
+        case CommandBuffer::Kind::Move:
+            if (PositionData* pd = e->getComponent<PositionData>())
+                tryMove(*pd, cmd.x, cmd.y);
+            break;
+        default:
+            break;
+        }
+    }
+
+    for (CommandBuffer& buffer : _commandBuffers)
+        buffer.clear();
+}
+
+void World::growCommandBuffers()
+{
+    if (_commandBuffers.size() < JOBS->getNumWorkers())
+        _commandBuffers.resize(JOBS->getNumWorkers());
+}
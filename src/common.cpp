@@ -8,3 +8,4 @@ const ComponentId InventoryData::id = ComponentId::Inventory;
 const ComponentId CreatureData::id = ComponentId::Creature;
 const ComponentId ActorData::id = ComponentId::Actor;
 const ComponentId PathfindingData::id = ComponentId::Pathfinding;
+const ComponentId GrowthData::id = ComponentId::Growth;
@@ -16,14 +16,21 @@
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <cstddef>
+#include <cstring>
+#include <cmath>
+#include <type_traits>
 using namespace std;
 using namespace std::chrono;
 
-#ifdef _OPENMP
-#include <omp.h>
-#endif
-
+#include "jobs.hpp"
+#include "patharena.hpp"
 #include "Matrix.hpp"
+#include "SpatialGrid.hpp"
+#include "OccupancyMap.hpp"
 #include "CompactMap.hpp"
 
 enum class ComponentId : uint8_t
@@ -37,6 +44,7 @@ enum class ComponentId : uint8_t
     Creature,
     Actor,
     Pathfinding,
+    Growth,
 };
 
 inline bool operator<(const ComponentId lhs, const ComponentId rhs)
@@ -44,6 +52,14 @@ inline bool operator<(const ComponentId lhs, const ComponentId rhs)
     return static_cast<uint8_t>(lhs) < static_cast<uint8_t>(rhs);
 }
 
+// one bit per ComponentId, so an entity's component set fits in a word
+typedef uint32_t ComponentMask;
+
+inline ComponentMask componentBit(ComponentId id)
+{
+    return 1u << static_cast<uint8_t>(id);
+}
+
 enum class ComponentFlags : uint8_t
 {
     None,
@@ -58,10 +74,14 @@ struct alignas(8) ComponentHandleData
 };
 
 typedef uint32_t ComponentHandle;
+const static ComponentHandle INVALID_COMPONENT = 0xFFFFFFFF;
 
+// counter is the slot's generation: it is bumped every time the slot is
+// recycled, so a handle to a destroyed entity no longer matches. Live
+// entities never have counter 0, so a default handle is always stale.
 struct alignas(8) EntityHandleData
 {
-    uint8_t counter;
+    uint32_t counter;
     uint32_t index;
 };
 
@@ -78,16 +98,21 @@ struct alignas(8) EntityHandle
         raw = 0LL;
     }
 
-    EntityHandle(uint32_t idx, uint8_t count=0)
+    EntityHandle(uint32_t idx, uint32_t count=0)
     {
         data.index = idx;
         data.counter = count;
     }
 
-    bool operator==(const EntityHandle& rhs)
+    bool operator==(const EntityHandle& rhs) const
     {
         return raw == rhs.raw;
     }
+
+    bool operator!=(const EntityHandle& rhs) const
+    {
+        return raw != rhs.raw;
+    }
 };
 
 enum class TerrainType : uint8_t
@@ -102,6 +127,16 @@ struct Terrain
 {
     // Material mat;
     TerrainType type;
+
+    bool operator==(const Terrain& rhs) const
+    {
+        return type == rhs.type;
+    }
+
+    bool operator!=(const Terrain& rhs) const
+    {
+        return type != rhs.type;
+    }
 };
 
 struct Position
@@ -110,9 +145,11 @@ struct Position
     int32_t y;
     int32_t z;
 
-    uint32_t distance_squared(const Position& other) const
+    uint64_t distance_squared(const Position& other) const
     {
-        return std::abs(x * other.x) + std::abs(y * other.y);
+        int64_t dx = x - other.x;
+        int64_t dy = y - other.y;
+        return static_cast<uint64_t>(dx * dx + dy * dy);
     }
 
     double distance(const Position& other) const
@@ -127,6 +164,12 @@ struct Component
     EntityHandle parent;
 };
 
+// schedule is the tick a system next needs to look at the component: 0
+// until one has, NOT_SCHEDULED while it's waiting on something else.
+// Whatever the system keeps count of in between is only brought up to
+// date when it wakes.
+const static uint64_t NOT_SCHEDULED = numeric_limits<uint64_t>::max();
+
 struct ScheduledComponent : Component
 {
     uint64_t schedule = 0;
@@ -159,8 +202,15 @@ struct PlantData : ScheduledComponent
     static const ComponentId id;
 
     uint8_t fruit = 0;
+};
+
+// How a plant grows. Every plant of a kind grows the same way, so plants
+// usually share their prefab's rather than having their own.
+struct GrowthData : Component
+{
+    static const ComponentId id;
+
     uint8_t max_fruit = 3;
-    uint16_t growth_status = 0;
     uint16_t growth_time = 100;
 };
 
@@ -176,6 +226,11 @@ struct CreatureData : ScheduledComponent
     static const ComponentId id;
 
     uint16_t eating_time = 250;
+
+    // Only as of when the creature was spawned. It goes up by one a tick
+    // but isn't written back, so snapshots and hashes don't change while
+    // the creature lives; its hunger at tick now is
+    // eating_time - (schedule - now).
     uint16_t hunger = 0;
 };
 
@@ -199,59 +254,289 @@ struct PathfindingData : ScheduledComponent
 {
     static const ComponentId id;
 
-    // We only use one position at a time, so a list should be better
-    list<Position> path;
+    // Steps left to take, in PATHS. at is the tile the next one starts
+    // from, and end where the last one leads.
+    PathCursor path;
+    Position at;
+    Position end;
+
+    // while following a flow field instead of a path, its goal square + 1
+    uint32_t flowGoal = 0;
 };
 
+// non-owning view of a contiguous array
 template<typename T>
-void printMemoryUsage(const vector<T>& v)
+struct Span
 {
-    uint64_t bytes = v.capacity() * sizeof(T);
-    double mem = bytes / 1024.0 / 1024.0;
-    cout << std::fixed << std::setprecision(2);
-    cout << typeid(T).name() << "\t" << mem << " MiB" << endl;
-}
+    T* ptr;
+    size_t count;
+
+    Span(T* p=nullptr, size_t n=0) : ptr(p), count(n) {}
+
+    T* begin() const { return ptr; }
+    T* end() const { return ptr + count; }
+    T* data() const { return ptr; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    T& operator[](size_t i) const { return ptr[i]; }
+};
 
-struct Operation
+const static size_t CACHE_LINE_SIZE = 64;
+
+// allocator for vectors whose storage should start on a cache line
+template<typename T, size_t Align = CACHE_LINE_SIZE>
+struct AlignedAllocator
 {
-    uint64_t timestamp;
-    std::function<void(void)> op;
+    typedef T value_type;
+
+    template<typename U>
+    struct rebind
+    {
+        typedef AlignedAllocator<U, Align> other;
+    };
+
+    AlignedAllocator() {}
+
+    template<typename U>
+    AlignedAllocator(const AlignedAllocator<U, Align>&) {}
+
+    T* allocate(size_t n)
+    {
+        // over-allocate, and stash the original pointer just below the
+        // aligned block
+        char* raw = static_cast<char*>(::operator new(n * sizeof(T) + Align + sizeof(void*)));
+        uintptr_t p = reinterpret_cast<uintptr_t>(raw + sizeof(void*));
+        p = (p + Align - 1) & ~static_cast<uintptr_t>(Align - 1);
+        reinterpret_cast<void**>(p)[-1] = raw;
+
+        // zeroed, so padding inside the elements doesn't leak whatever was
+        // there before into snapshots and state hashes
+        memset(reinterpret_cast<void*>(p), 0, n * sizeof(T));
+        return reinterpret_cast<T*>(p);
+    }
+
+    void deallocate(T* p, size_t)
+    {
+        ::operator delete(reinterpret_cast<void**>(p)[-1]);
+    }
+
+    template<typename U>
+    bool operator==(const AlignedAllocator<U, Align>&) const { return true; }
+
+    template<typename U>
+    bool operator!=(const AlignedAllocator<U, Align>&) const { return false; }
 };
 
-// very simple, very fast, very specific
-// static size, concurrent write-only, then read
-template<typename T, size_t maxSize>
-class LocklessQueue
+// append a plain-data value to a byte buffer
+template<typename T>
+void writeBytes(vector<char>& out, const T& v)
+{
+    static_assert(std::is_trivially_copyable<T>::value, "writeBytes needs plain data");
+    const char* p = reinterpret_cast<const char*>(&v);
+    out.insert(out.end(), p, p + sizeof(T));
+}
+
+template<typename T>
+void writeBytes(vector<char>& out, const T* v, size_t count)
 {
-public:
-    LocklessQueue()
+    static_assert(std::is_trivially_copyable<T>::value, "writeBytes needs plain data");
+    const char* p = reinterpret_cast<const char*>(v);
+    out.insert(out.end(), p, p + sizeof(T) * count);
+}
+
+// read a plain-data value and advance the read pointer
+template<typename T>
+void readBytes(const char*& in, T& v)
+{
+    static_assert(std::is_trivially_copyable<T>::value, "readBytes needs plain data");
+    memcpy(&v, in, sizeof(T));
+    in += sizeof(T);
+}
+
+template<typename T>
+void readBytes(const char*& in, T* v, size_t count)
+{
+    static_assert(std::is_trivially_copyable<T>::value, "readBytes needs plain data");
+    memcpy(v, in, sizeof(T) * count);
+    in += sizeof(T) * count;
+}
+
+// splitmix64's finalizer: cheap, and every input bit affects every output bit
+inline uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+inline uint64_t hashBytes(const void* data, size_t size, uint64_t seed)
+{
+    const char* p = static_cast<const char*>(data);
+    uint64_t h = mix64(seed ^ size);
+    for (; size >= 8; size -= 8, p += 8)
     {
-        reset();
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h = mix64(h ^ w);
     }
+    if (size > 0)
+    {
+        uint64_t w = 0;
+        memcpy(&w, p, size);
+        h = mix64(h ^ w);
+    }
+    return h;
+}
+
+// Counter-based random numbers: the sequence is a pure function of
+// (key, counter), so it doesn't matter which thread draws it or when.
+// Key it with an entity handle and the tick for per-entity randomness
+// that's the same on every run. Usable as a standard URBG.
+class CounterRandom
+{
+public:
+    typedef uint64_t result_type;
 
-    void push(T& obj)
+    CounterRandom(uint64_t key, uint64_t counter)
     {
-        size_t idx = _index++;
-        _data[idx] = obj;
+        _state = mix64(key ^ mix64(counter));
     }
 
-    auto begin()
+    uint64_t next()
     {
-        return _data.begin();
+        _state += 0x9e3779b97f4a7c15ULL;
+        return mix64(_state);
     }
 
-    auto end()
+    // in [0, n)
+    uint32_t below(uint32_t n)
     {
-        return _data.begin() + _index;
+        return static_cast<uint32_t>(((next() >> 32) * n) >> 32);
     }
 
-    void reset()
+    // in [0, 1)
+    double uniform()
     {
-       _data.resize(maxSize);
-       _index = 0;
+        return (next() >> 11) * (1.0 / 9007199254740992.0);
     }
 
+    static constexpr uint64_t min() { return 0; }
+    static constexpr uint64_t max() { return ~0ULL; }
+    uint64_t operator()() { return next(); }
+
 private:
-    atomic<size_t> _index;
-    vector<T> _data;
+    uint64_t _state;
 };
+
+// pad a byte buffer with zeros up to a multiple of align
+inline void padBytes(vector<char>& out, size_t align)
+{
+    out.resize((out.size() + align - 1) / align * align, 0);
+}
+
+// skip a read pointer ahead to the next multiple of align; only matches
+// padBytes() if the buffer itself started aligned
+inline void alignPointer(const char*& in, size_t align)
+{
+    uintptr_t p = reinterpret_cast<uintptr_t>(in);
+    in += (align - p % align) % align;
+}
+
+// Byte serialization of a single component. Plain-data components are
+// copied as they are; components that own memory specialize this, set
+// plain to false, and free the memory in release(), which the pool calls
+// when a component leaves it.
+template<typename T>
+struct ComponentIO
+{
+    static const bool plain = std::is_trivially_copyable<T>::value;
+
+    static void release(T&)
+    {
+    }
+
+    static void write(vector<char>& out, const T& c)
+    {
+        writeBytes(out, c);
+    }
+
+    static void read(const char*& in, T& c)
+    {
+        readBytes(in, c);
+    }
+};
+
+template<>
+struct ComponentIO<NameData>
+{
+    static const bool plain = false;
+
+    static void release(NameData&)
+    {
+    }
+
+    static void write(vector<char>& out, const NameData& c)
+    {
+        writeBytes(out, c.parent);
+        writeBytes(out, static_cast<uint32_t>(c.name.size()));
+        writeBytes(out, c.name.data(), c.name.size());
+    }
+
+    static void read(const char*& in, NameData& c)
+    {
+        uint32_t len;
+        readBytes(in, c.parent);
+        readBytes(in, len);
+        c.name.assign(in, len);
+        in += len;
+    }
+};
+
+// The steps are written out in full, so what's written doesn't depend on
+// where in PATHS they happened to be stored.
+template<>
+struct ComponentIO<PathfindingData>
+{
+    static const bool plain = false;
+
+    static void release(PathfindingData& c)
+    {
+        PATHS->release(c.path);
+    }
+
+    static void write(vector<char>& out, const PathfindingData& c)
+    {
+        writeBytes(out, c.parent);
+        writeBytes(out, c.schedule);
+        writeBytes(out, c.at);
+        writeBytes(out, c.end);
+        writeBytes(out, c.flowGoal);
+        writeBytes(out, c.path.left);
+        PATHS->forEach(c.path, [&](uint8_t step) { writeBytes(out, step); });
+    }
+
+    static void read(const char*& in, PathfindingData& c)
+    {
+        uint32_t len;
+        readBytes(in, c.parent);
+        readBytes(in, c.schedule);
+        readBytes(in, c.at);
+        readBytes(in, c.end);
+        readBytes(in, c.flowGoal);
+        readBytes(in, len);
+        c.path = PATHS->store(reinterpret_cast<const uint8_t*>(in), len);
+        in += len;
+    }
+};
+
+template<typename T, typename A>
+void printMemoryUsage(const vector<T, A>& v)
+{
+    uint64_t bytes = v.capacity() * sizeof(T);
+    double mem = bytes / 1024.0 / 1024.0;
+    cout << std::fixed << std::setprecision(2);
+    cout << typeid(T).name() << "\t" << mem << " MiB" << endl;
+}
@@ -0,0 +1,375 @@
+#include "flowfield.hpp"
+
+// steps by direction index; d ^ 1 is the opposite of d
+static const int DIRS[8][2] = {
+    { 1, 0 }, { -1, 0 }, { 0, 1 }, { 0, -1 },
+    { 1, 1 }, { -1, -1 }, { 1, -1 }, { -1, 1 },
+};
+
+const uint8_t FlowFields::AT_GOAL;
+const uint8_t FlowFields::NO_WAY;
+
+FlowFields::FlowFields(World& world, Pathfinder& pathfinder) : _world(world), _pathfinder(pathfinder)
+{
+    _chunksX = world.getWidth() / CHUNK_SIZE;
+    _goalsX = world.getWidth() / FLOW_GOAL_SIZE;
+    _byGoal.assign(_goalsX * (world.getHeight() / FLOW_GOAL_SIZE), -1);
+}
+
+FlowFields::~FlowFields()
+{
+}
+
+uint32_t FlowFields::goalAt(const Position& pos) const
+{
+    return (pos.y / FLOW_GOAL_SIZE) * _goalsX + pos.x / FLOW_GOAL_SIZE;
+}
+
+bool FlowFields::inGoal(uint32_t goal, const Position& pos) const
+{
+    return goalAt(pos) == goal;
+}
+
+bool FlowFields::covers(uint32_t goal, const Position& pos) const
+{
+    int cx = static_cast<int>((goal % _goalsX) * FLOW_GOAL_SIZE / CHUNK_SIZE);
+    int cy = static_cast<int>((goal / _goalsX) * FLOW_GOAL_SIZE / CHUNK_SIZE);
+    return std::abs(pos.x / static_cast<int>(CHUNK_SIZE) - cx) <= FLOW_FIELD_RADIUS &&
+        std::abs(pos.y / static_cast<int>(CHUNK_SIZE) - cy) <= FLOW_FIELD_RADIUS;
+}
+
+FlowFieldStats FlowFields::getStats() const
+{
+    FlowFieldStats stats;
+    for (auto& f : _fields) {
+        if (f)
+            stats.fields++;
+    }
+    stats.fieldsBuilt = _fieldsBuilt;
+    stats.chunksBuilt = _chunksBuilt;
+    return stats;
+}
+
+void FlowFields::retain(uint32_t goal)
+{
+    if (goal >= _byGoal.size())
+        return;
+
+    int32_t at = _byGoal[goal];
+    if (at < 0)
+    {
+        if (!_freeSlots.empty()) {
+            at = _freeSlots.back();
+            _freeSlots.pop_back();
+        }
+        else {
+            at = static_cast<int32_t>(_fields.size());
+            _fields.emplace_back();
+        }
+
+        unique_ptr<Field> f(new Field);
+        int cx = static_cast<int>((goal % _goalsX) * FLOW_GOAL_SIZE / CHUNK_SIZE);
+        int cy = static_cast<int>((goal / _goalsX) * FLOW_GOAL_SIZE / CHUNK_SIZE);
+        f->goal = goal;
+        f->cx0 = std::max(0, cx - FLOW_FIELD_RADIUS);
+        f->cy0 = std::max(0, cy - FLOW_FIELD_RADIUS);
+        f->cx1 = std::min(static_cast<int>(_chunksX), cx + FLOW_FIELD_RADIUS + 1);
+        f->cy1 = std::min(static_cast<int>(_world.getHeight() / CHUNK_SIZE), cy + FLOW_FIELD_RADIUS + 1);
+        f->chunks.reset(new atomic<ChunkField*>[f->numChunks()]);
+        for (size_t i = 0; i < f->numChunks(); ++i)
+            f->chunks[i] = nullptr;
+        exits(*f);
+
+        _fields[at] = std::move(f);
+        _byGoal[goal] = at;
+        _fieldsBuilt++;
+    }
+    _fields[at]->references++;
+}
+
+void FlowFields::refresh()
+{
+    for (size_t i = 0; i < _fields.size(); ++i)
+    {
+        Field* f = _fields[i].get();
+        if (!f)
+            continue;
+
+        if (f->references == 0) {
+            _byGoal[f->goal] = -1;
+            _fields[i].reset();
+            _freeSlots.push_back(static_cast<int32_t>(i));
+            continue;
+        }
+        f->references = 0;
+
+        bool changed = false;
+        for (size_t slot = 0; slot < f->numChunks() && !changed; ++slot)
+        {
+            uint32_t versions[5];
+            _pathfinder.versions(chunkAt(*f, slot), versions);
+            changed = memcmp(versions, &f->versions[slot * 5], sizeof(versions)) != 0;
+        }
+        if (!changed)
+            continue;
+
+        // a chunk only needs new directions if its own walls or the
+        // distances at its exits changed
+        exits(*f);
+        for (size_t slot = 0; slot < f->numChunks(); ++slot)
+        {
+            ChunkField* c = f->chunks[slot].load(memory_order_relaxed);
+            if (!c)
+                continue;
+            if (memcmp(&f->versions[slot * 5], c->versions, sizeof(c->versions)) != 0 || c->seeds != f->exits[slot]) {
+                delete c;
+                f->chunks[slot] = nullptr;
+            }
+        }
+    }
+}
+
+bool FlowFields::chunkSlot(const Field& f, uint32_t idx, size_t& slot) const
+{
+    int cx = static_cast<int>(idx % _chunksX);
+    int cy = static_cast<int>(idx / _chunksX);
+    if (cx < f.cx0 || cy < f.cy0 || cx >= f.cx1 || cy >= f.cy1)
+        return false;
+    slot = static_cast<size_t>(cy - f.cy0) * (f.cx1 - f.cx0) + (cx - f.cx0);
+    return true;
+}
+
+uint32_t FlowFields::chunkAt(const Field& f, size_t slot) const
+{
+    size_t width = f.cx1 - f.cx0;
+    return static_cast<uint32_t>((f.cy0 + slot / width) * _chunksX + f.cx0 + slot % width);
+}
+
+// the open tiles of the goal square, if it's in chunk idx
+void FlowFields::goalSeeds(const Field& f, uint32_t idx, vector<Seed>& out)
+{
+    int gx = static_cast<int>((f.goal % _goalsX) * FLOW_GOAL_SIZE);
+    int gy = static_cast<int>((f.goal / _goalsX) * FLOW_GOAL_SIZE);
+    if (_world.chunkIndex(gx, gy) != idx)
+        return;
+
+    const Pathfinder::ChunkGraph& g = _pathfinder.graph(idx);
+    for (int y = gy; y < gy + static_cast<int>(FLOW_GOAL_SIZE); ++y)
+    {
+        for (int x = gx; x < gx + static_cast<int>(FLOW_GOAL_SIZE); ++x)
+        {
+            uint32_t cell = WorldChunk::cellIndex(x, y);
+            if (g.isOpen(cell))
+                out.push_back(Seed{ static_cast<uint16_t>(cell), AT_GOAL, 0 });
+        }
+    }
+}
+
+// Dijkstra over the chunk from all of seeds at once. cost ends up with
+// each tile's distance to the goal, and dirs, if given, with the first
+// step of the way there.
+void FlowFields::integrate(const Pathfinder::ChunkGraph& g, const vector<Seed>& seeds, vector<uint32_t>& cost,
+    vector<uint8_t>* dirs) const
+{
+    const uint32_t UNREACHABLE = Pathfinder::UNREACHABLE;
+    cost.assign(CHUNK_SIZE * CHUNK_SIZE, UNREACHABLE);
+    if (dirs)
+        dirs->assign(CHUNK_SIZE * CHUNK_SIZE, NO_WAY);
+
+    typedef pair<uint32_t, uint32_t> Entry;    // (cost, cell)
+    vector<Entry> open;
+    auto later = greater<Entry>();
+    for (const Seed& s : seeds)
+    {
+        if (s.cost >= cost[s.cell])
+            continue;
+        cost[s.cell] = s.cost;
+        if (dirs)
+            (*dirs)[s.cell] = s.dir;
+        open.emplace_back(s.cost, s.cell);
+    }
+    make_heap(open.begin(), open.end(), later);
+
+    const int size = static_cast<int>(CHUNK_SIZE);
+    while (!open.empty())
+    {
+        pop_heap(open.begin(), open.end(), later);
+        Entry top = open.back();
+        open.pop_back();
+        if (top.first != cost[top.second])
+            continue;
+
+        int x = static_cast<int>(top.second % CHUNK_SIZE);
+        int y = static_cast<int>(top.second / CHUNK_SIZE);
+        for (int d = 0; d < 8; ++d)
+        {
+            int nx = x + DIRS[d][0];
+            int ny = y + DIRS[d][1];
+            if (nx < 0 || ny < 0 || nx >= size || ny >= size || !g.isOpen(ny * size + nx))
+                continue;
+
+            // no cutting corners past walls
+            uint32_t step = STRAIGHT_COST;
+            if (d >= 4) {
+                if (!g.isOpen(y * size + nx) || !g.isOpen(ny * size + x))
+                    continue;
+                step = DIAGONAL_COST;
+            }
+
+            uint32_t next = static_cast<uint32_t>(ny * size + nx);
+            if (top.first + step >= cost[next])
+                continue;
+            cost[next] = top.first + step;
+            if (dirs)
+                (*dirs)[next] = static_cast<uint8_t>(d ^ 1);
+            open.emplace_back(cost[next], next);
+            push_heap(open.begin(), open.end(), later);
+        }
+    }
+}
+
+// Dijkstra over the portals of the chunks f covers, outward from the goal
+// square. A portal whose best way to the goal is to cross its border
+// becomes an exit, where that chunk's directions start from.
+void FlowFields::exits(Field& f)
+{
+    typedef Pathfinder::ChunkGraph ChunkGraph;
+    Pathfinder::Scratch& s = *_pathfinder._scratch[JobSystem::currentWorker()];
+    const uint32_t UNREACHABLE = Pathfinder::UNREACHABLE;
+
+    f.versions.resize(f.numChunks() * 5);
+    f.exits.resize(f.numChunks());
+    for (size_t slot = 0; slot < f.numChunks(); ++slot)
+    {
+        uint32_t idx = chunkAt(f, slot);
+        _pathfinder.versions(idx, &f.versions[slot * 5]);
+        f.exits[slot].assign(_pathfinder.graph(idx).portals.size(), UNREACHABLE);
+    }
+
+    int gx = static_cast<int>((f.goal % _goalsX) * FLOW_GOAL_SIZE);
+    int gy = static_cast<int>((f.goal / _goalsX) * FLOW_GOAL_SIZE);
+    uint32_t goalIdx = _world.chunkIndex(gx, gy);
+    const ChunkGraph& gg = _pathfinder.graph(goalIdx);
+    vector<Seed> seeds;
+    vector<uint32_t> cost;
+    goalSeeds(f, goalIdx, seeds);
+    integrate(gg, seeds, cost, nullptr);
+
+    // (distance, crossed its border to get there) per portal reached
+    auto key = [](uint32_t idx, size_t portal) { return (static_cast<uint64_t>(idx) << 16) | portal; };
+    typedef pair<uint32_t, uint64_t> Entry;
+    unordered_map<uint64_t, pair<uint32_t, bool>> best;
+    vector<Entry> open;
+    auto later = greater<Entry>();
+    auto push = [&](uint32_t idx, size_t portal, uint32_t d, bool crossed) {
+        size_t slot;
+        if (!chunkSlot(f, idx, slot))
+            return;
+        auto it = best.find(key(idx, portal));
+        if (it != best.end() && it->second.first <= d)
+            return;
+        best[key(idx, portal)] = make_pair(d, crossed);
+        open.emplace_back(d, key(idx, portal));
+        push_heap(open.begin(), open.end(), later);
+    };
+
+    for (size_t i = 0; i < gg.portals.size(); ++i)
+    {
+        if (cost[gg.portals[i]] != UNREACHABLE)
+            push(goalIdx, i, cost[gg.portals[i]], false);
+    }
+
+    while (!open.empty())
+    {
+        pop_heap(open.begin(), open.end(), later);
+        Entry top = open.back();
+        open.pop_back();
+        if (top.first != best[top.second].first)
+            continue;
+
+        uint32_t idx = static_cast<uint32_t>(top.second >> 16);
+        size_t i = top.second & 0xFFFF;
+        const ChunkGraph& g = _pathfinder.linkedGraph(s, idx);
+        size_t count = g.portals.size();
+        for (size_t j = 0; j < count; ++j)
+        {
+            uint32_t d = g.dist[i * count + j];
+            if (j != i && d != UNREACHABLE)
+                push(idx, j, top.first + d, false);
+        }
+
+        uint32_t other;
+        size_t j;
+        if (_pathfinder.twin(g, i, idx, other, j))
+            push(other, j, top.first + STRAIGHT_COST, true);
+    }
+
+    for (auto& b : best)
+    {
+        size_t slot;
+        if (b.second.second && chunkSlot(f, static_cast<uint32_t>(b.first >> 16), slot))
+            f.exits[slot][b.first & 0xFFFF] = b.second.first;
+    }
+}
+
+FlowFields::ChunkField* FlowFields::buildChunk(Field& f, size_t slot, uint32_t idx)
+{
+    lock_guard<mutex> lck(f.mtx);
+    ChunkField* c = f.chunks[slot].load(memory_order_acquire);
+    if (c)
+        return c;
+
+    const Pathfinder::ChunkGraph& g = _pathfinder.graph(idx);
+    c = new ChunkField;
+    memcpy(c->versions, &f.versions[slot * 5], sizeof(c->versions));
+    c->seeds = f.exits[slot];
+
+    // an exit's first step is across its border
+    vector<Seed> seeds;
+    goalSeeds(f, idx, seeds);
+    for (size_t i = 0; i < g.portals.size(); ++i)
+    {
+        if (c->seeds[i] == Pathfinder::UNREACHABLE)
+            continue;
+        uint8_t dir;
+        switch (g.sides[i])
+        {
+        case Pathfinder::Left: dir = 1; break;
+        case Pathfinder::Right: dir = 0; break;
+        case Pathfinder::Top: dir = 3; break;
+        default: dir = 2; break;
+        }
+        seeds.push_back(Seed{ g.portals[i], dir, c->seeds[i] });
+    }
+
+    vector<uint32_t> cost;
+    integrate(g, seeds, cost, &c->dirs);
+
+    f.chunks[slot].store(c, memory_order_release);
+    _chunksBuilt++;
+    return c;
+}
+
+bool FlowFields::direction(uint32_t goal, const Position& pos, int& dx, int& dy)
+{
+    int32_t at = goal < _byGoal.size() ? _byGoal[goal] : -1;
+    if (at < 0)
+        return false;
+
+    Field& f = *_fields[at];
+    uint32_t idx = _world.chunkIndex(pos.x, pos.y);
+    size_t slot;
+    if (!chunkSlot(f, idx, slot))
+        return false;
+
+    ChunkField* c = f.chunks[slot].load(memory_order_acquire);
+    if (!c)
+        c = buildChunk(f, slot, idx);
+
+    uint8_t d = c->dirs[WorldChunk::cellIndex(pos.x, pos.y)];
+    if (d >= AT_GOAL)
+        return false;
+    dx = DIRS[d][0];
+    dy = DIRS[d][1];
+    return true;
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include "common.hpp"
+#include "wsim.hpp"
+#include "pathfinding.hpp"
+
+// Goals are squares of this many tiles a side, aligned like the spatial
+// index cells, so everyone heading for the same patch of food shares one
+// field.
+const static uint32_t FLOW_GOAL_SIZE = SPATIAL_CELL_SIZE;
+
+// a field covers the chunks at most this many chunks from its goal's
+const static int FLOW_FIELD_RADIUS = 3;
+
+// Direction fields toward goal squares, shared by everyone heading the
+// same way. A field keeps the walking distance from each portal around
+// its goal (see Pathfinder) to the goal, found with one Dijkstra over the
+// portals. Each chunk's directions are worked out from those the first
+// time someone in the chunk asks, so following a field costs one lookup
+// per step however many follow it.
+//
+// Fields are reference counted a tick at a time: whoever follows one
+// retain()s it every tick, and refresh() drops those nobody retained.
+// When walls change, refresh() redoes the portal distances and only
+// rebuilds the chunks whose walls or distances on their borders changed.
+class FlowFields
+{
+public:
+    FlowFields(World& world, Pathfinder& pathfinder);
+    ~FlowFields();
+
+    // the goal square containing pos
+    uint32_t goalAt(const Position& pos) const;
+    bool inGoal(uint32_t goal, const Position& pos) const;
+
+    // whether the field toward goal would cover pos
+    bool covers(uint32_t goal, const Position& pos) const;
+
+    // Counts a reference to the field toward goal for this tick, creating
+    // it if there isn't one. Not thread safe.
+    void retain(uint32_t goal);
+
+    // The step to take from pos toward goal, or false if pos is in the
+    // goal square, outside the field or can't reach the goal. Safe to call
+    // from several threads at once.
+    bool direction(uint32_t goal, const Position& pos, int& dx, int& dy);
+
+    // Drops fields nobody retained since the last call, and catches the
+    // rest up with wall changes. Call after Pathfinder::refresh(), while
+    // no lookups run.
+    void refresh();
+
+    FlowFieldStats getStats() const;
+
+private:
+    const static uint8_t AT_GOAL = 8;
+    const static uint8_t NO_WAY = 9;
+
+    // a tile a chunk's directions start from, already knowing its way
+    struct Seed
+    {
+        uint16_t cell;
+        uint8_t dir;
+        uint32_t cost;
+    };
+
+    struct ChunkField
+    {
+        uint32_t versions[5];       // of the chunk and its neighbours, see Pathfinder::versions()
+        vector<uint32_t> seeds;     // the exits it was built from
+        vector<uint8_t> dirs;       // per tile, an index into DIRS, AT_GOAL or NO_WAY
+    };
+
+    struct Field
+    {
+        uint32_t goal;
+        uint32_t references = 0;
+        int cx0;                    // chunks covered, [cx0, cx1) x [cy0, cy1)
+        int cy0;
+        int cx1;
+        int cy1;
+        vector<uint32_t> versions;  // 5 per chunk covered as of the last exits(), see Pathfinder::versions()
+
+        // Per chunk covered, per portal: the distance to the goal for
+        // portals where the way to the goal crosses the border, and
+        // UNREACHABLE for the rest.
+        vector<vector<uint32_t>> exits;
+        unique_ptr<atomic<ChunkField*>[]> chunks;
+        mutex mtx;
+
+        ~Field()
+        {
+            for (size_t i = 0; i < numChunks(); ++i)
+                delete chunks[i].load();
+        }
+
+        size_t numChunks() const { return static_cast<size_t>(cx1 - cx0) * (cy1 - cy0); }
+    };
+
+    void exits(Field& f);
+    ChunkField* buildChunk(Field& f, size_t slot, uint32_t idx);
+    void goalSeeds(const Field& f, uint32_t idx, vector<Seed>& out);
+    void integrate(const Pathfinder::ChunkGraph& g, const vector<Seed>& seeds, vector<uint32_t>& cost,
+        vector<uint8_t>* dirs) const;
+    bool chunkSlot(const Field& f, uint32_t idx, size_t& slot) const;
+    uint32_t chunkAt(const Field& f, size_t slot) const;
+
+    World& _world;
+    Pathfinder& _pathfinder;
+    uint32_t _chunksX;
+    uint32_t _goalsX;
+    vector<int32_t> _byGoal;    // goal square -> index in _fields, or -1
+    vector<unique_ptr<Field>> _fields;
+    vector<int32_t> _freeSlots;
+
+    uint64_t _fieldsBuilt = 0;
+    atomic<uint64_t> _chunksBuilt{0};
+};
@@ -0,0 +1,58 @@
+#include "framearena.hpp"
+
+const size_t FrameArena::BLOCK_SIZE;
+
+FrameArena* FrameArena::getSingleton()
+{
+    static unique_ptr<FrameArena> instance;
+    if (!instance)
+        instance.reset(new FrameArena);
+    return instance.get();
+}
+
+FrameArena::FrameArena()
+{
+    for (size_t i = 0; i < JOBS->getNumWorkers(); ++i)
+        _workers.emplace_back(new Worker);
+}
+
+// Moves on to the next block, putting in a new one if that's too small.
+// The rest of the current block goes unused until the reset.
+void* FrameArena::allocateSlow(Worker& w, size_t bytes, size_t align)
+{
+    assert(align <= CACHE_LINE_SIZE);
+    size_t next = w.blocks.empty() ? 0 : w.current + 1;
+    if (next >= w.blocks.size() || w.blocks[next].size() < bytes)
+        w.blocks.emplace(w.blocks.begin() + next, bytes > BLOCK_SIZE ? bytes : BLOCK_SIZE);
+
+    w.current = next;
+    w.offset = bytes;
+    w.used += bytes;
+    w.peak = std::max(w.peak, w.used);
+    return w.blocks[next].data();
+}
+
+void FrameArena::reset()
+{
+    while (_workers.size() < JOBS->getNumWorkers())
+        _workers.emplace_back(new Worker);
+
+    _stats.lastTick = 0;
+    _stats.reserved = 0;
+    for (auto& w : _workers)
+    {
+        _stats.lastTick += w->peak;
+        for (const Block& b : w->blocks)
+            _stats.reserved += b.size();
+        w->current = 0;
+        w->offset = 0;
+        w->used = 0;
+        w->peak = 0;
+    }
+    _stats.peak = std::max(_stats.peak, _stats.lastTick);
+}
+
+FrameArenaStats FrameArena::getStats() const
+{
+    return _stats;
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include "common.hpp"
+
+#define FRAME FrameArena::getSingleton()
+
+struct FrameArenaStats
+{
+    size_t lastTick = 0;        // most in use during the last tick, all workers together
+    size_t peak = 0;            // most used in any one tick
+    size_t reserved = 0;        // held in blocks, kept from tick to tick
+};
+
+// Scratch memory that lives for one tick. Each worker bumps a pointer
+// through its own blocks, so allocating is a few instructions and never
+// locks, and Game::tick frees everything at once by resetting them at the
+// end of the tick. Whatever is allocated here must not be used after
+// that, nor need its destructor run.
+class FrameArena
+{
+public:
+    static FrameArena* getSingleton();
+
+    FrameArena();
+
+    // from the calling worker's blocks
+    void* allocate(size_t bytes, size_t align)
+    {
+        Worker& w = *_workers[JobSystem::currentWorker()];
+        size_t at = (w.offset + align - 1) & ~(align - 1);
+        if (w.current < w.blocks.size() && at + bytes <= w.blocks[w.current].size()) {
+            w.used += at + bytes - w.offset;
+            w.offset = at + bytes;
+            w.peak = std::max(w.peak, w.used);
+            return w.blocks[w.current].data() + at;
+        }
+        return allocateSlow(w, bytes, align);
+    }
+
+    // Gives back the calling worker's last allocation, if p is it, so
+    // scratch that's made and dropped again in a loop doesn't pile up.
+    void deallocate(void* p, size_t bytes)
+    {
+        Worker& w = *_workers[JobSystem::currentWorker()];
+        if (w.current < w.blocks.size() && static_cast<char*>(p) + bytes == w.blocks[w.current].data() + w.offset) {
+            w.offset -= bytes;
+            w.used -= bytes;
+        }
+    }
+
+    template<typename T>
+    Span<T> allocSpan(size_t count)
+    {
+        return Span<T>(static_cast<T*>(allocate(count * sizeof(T), alignof(T))), count);
+    }
+
+    // Frees everything at once. Call between ticks, while nothing else
+    // uses the arena.
+    void reset();
+
+    FrameArenaStats getStats() const;
+
+private:
+    const static size_t BLOCK_SIZE = 256 * 1024;
+
+    // cache line aligned, so aligning an offset into one aligns the address
+    typedef vector<char, AlignedAllocator<char>> Block;
+
+    struct Worker
+    {
+        vector<Block> blocks;
+        size_t current = 0;     // block being bumped through
+        size_t offset = 0;      // into it
+        size_t used = 0;        // since the last reset, including padding
+        size_t peak = 0;
+    };
+
+    void* allocateSlow(Worker& w, size_t bytes, size_t align);
+
+    vector<unique_ptr<Worker>> _workers;    // one per worker
+    FrameArenaStats _stats;
+};
+
+// STL allocator drawing from FrameArena, for containers that only live
+// for the tick
+template<typename T>
+struct FrameAllocator
+{
+    typedef T value_type;
+
+    template<typename U>
+    struct rebind
+    {
+        typedef FrameAllocator<U> other;
+    };
+
+    FrameAllocator() {}
+
+    template<typename U>
+    FrameAllocator(const FrameAllocator<U>&) {}
+
+    T* allocate(size_t n)
+    {
+        return static_cast<T*>(FRAME->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* p, size_t n)
+    {
+        FRAME->deallocate(p, n * sizeof(T));
+    }
+
+    template<typename U>
+    bool operator==(const FrameAllocator<U>&) const { return true; }
+
+    template<typename U>
+    bool operator!=(const FrameAllocator<U>&) const { return false; }
+};
+
+template<typename T>
+using FrameVector = vector<T, FrameAllocator<T>>;
@@ -0,0 +1,166 @@
+#include "jobs.hpp"
+
+static thread_local size_t t_workerIndex = 0;
+
+JobSystem* JobSystem::getSingleton()
+{
+    static std::unique_ptr<JobSystem> instance;
+    if (!instance) {
+        instance.reset(new JobSystem());
+        instance->init();
+    }
+    return instance.get();
+}
+
+JobSystem::JobSystem()
+{
+}
+
+JobSystem::~JobSystem()
+{
+    shutdown();
+}
+
+void JobSystem::init(size_t numWorkers)
+{
+    shutdown();
+
+    if (numWorkers == 0)
+        numWorkers = std::max(1u, std::thread::hardware_concurrency());
+
+    _queues.clear();
+    for (size_t i = 0; i < numWorkers; ++i)
+        _queues.emplace_back(new WorkerQueue);
+
+    t_workerIndex = 0;
+    _running = true;
+    for (size_t i = 1; i < numWorkers; ++i)
+        _threads.emplace_back(&JobSystem::workerLoop, this, i);
+}
+
+void JobSystem::shutdown()
+{
+    if (!_running)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lck(_sleepMtx);
+        _running = false;
+    }
+    _sleepCv.notify_all();
+
+    for (auto& t : _threads)
+        t.join();
+    _threads.clear();
+}
+
+size_t JobSystem::currentWorker()
+{
+    return t_workerIndex;
+}
+
+void JobSystem::submit(JobGroup* group, std::function<void()> fn)
+{
+    group->pending++;
+
+    WorkerQueue& q = *_queues[currentWorker()];
+    {
+        std::lock_guard<std::mutex> lck(q.mtx);
+        q.jobs.push_back(Job{ std::move(fn), group });
+    }
+    _queued++;
+
+    if (_threads.size() > 0) {
+        std::lock_guard<std::mutex> lck(_sleepMtx);
+        _sleepCv.notify_one();
+    }
+}
+
+void JobSystem::wait(JobGroup* group)
+{
+    size_t self = currentWorker();
+    while (group->pending > 0)
+    {
+        if (!tryRunOne(self))
+            std::this_thread::yield();
+    }
+}
+
+void JobSystem::parallelFor(size_t begin, size_t end, size_t grain, const std::function<void(size_t, size_t)>& fn)
+{
+    if (end <= begin)
+        return;
+
+    grain = std::max<size_t>(grain, 1);
+    if (end - begin <= grain || _queues.size() == 1) {
+        fn(begin, end);
+        return;
+    }
+
+    JobGroup group;
+    for (size_t b = begin; b < end; b += grain)
+    {
+        size_t e = std::min(b + grain, end);
+        submit(&group, [&fn, b, e] { fn(b, e); });
+    }
+    wait(&group);
+}
+
+void JobSystem::workerLoop(size_t index)
+{
+    t_workerIndex = index;
+
+    while (_running)
+    {
+        if (tryRunOne(index))
+            continue;
+
+        std::unique_lock<std::mutex> lck(_sleepMtx);
+        _sleepCv.wait(lck, [&] { return _queued > 0 || !_running; });
+    }
+}
+
+bool JobSystem::tryRunOne(size_t self)
+{
+    if (_queued == 0)
+        return false;
+
+    Job job;
+    bool found = false;
+
+    // newest job from our own deque first, it's most likely still in cache
+    {
+        WorkerQueue& q = *_queues[self];
+        std::lock_guard<std::mutex> lck(q.mtx);
+        if (!q.jobs.empty()) {
+            job = std::move(q.jobs.back());
+            q.jobs.pop_back();
+            found = true;
+        }
+    }
+
+    // then steal the oldest job from someone else
+    for (size_t i = 1; !found && i < _queues.size(); ++i)
+    {
+        WorkerQueue& q = *_queues[(self + i) % _queues.size()];
+        std::lock_guard<std::mutex> lck(q.mtx);
+        if (!q.jobs.empty()) {
+            job = std::move(q.jobs.front());
+            q.jobs.pop_front();
+            found = true;
+        }
+    }
+
+    if (!found)
+        return false;
+
+    _queued--;
+    run(job);
+    return true;
+}
+
+void JobSystem::run(Job& job)
+{
+    job.fn();
+    job.group->pending--;
+}
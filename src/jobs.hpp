@@ -0,0 +1,75 @@
+#pragma once
+
+#include <thread>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+
+#define JOBS JobSystem::getSingleton()
+
+// Counts outstanding jobs; wait() on it to block until they're all done.
+struct JobGroup
+{
+    std::atomic<size_t> pending{0};
+};
+
+// Work-stealing thread pool. Every worker owns a deque: it pushes and pops
+// its own jobs at the back, and steals from the front of other workers'
+// deques when it runs dry. The thread that calls init() is worker 0 and
+// runs jobs whenever it waits on a JobGroup, so a pool of N workers starts
+// N-1 threads.
+class JobSystem
+{
+public:
+    static JobSystem* getSingleton();
+
+    JobSystem();
+    ~JobSystem();
+
+    // (re)start the pool with this many workers; 0 means one per core
+    void init(size_t numWorkers = 0);
+    size_t getNumWorkers() const { return _queues.size(); }
+
+    // index of the calling worker; threads outside the pool count as 0
+    static size_t currentWorker();
+
+    void submit(JobGroup* group, std::function<void()> fn);
+
+    // run jobs until group has none left
+    void wait(JobGroup* group);
+
+    // Splits [begin, end) into ranges of about grain items and calls
+    // fn(rangeBegin, rangeEnd) for each one on the pool. Returns when all
+    // ranges are done.
+    void parallelFor(size_t begin, size_t end, size_t grain, const std::function<void(size_t, size_t)>& fn);
+
+private:
+    struct Job
+    {
+        std::function<void()> fn;
+        JobGroup* group;
+    };
+
+    struct WorkerQueue
+    {
+        std::mutex mtx;
+        std::deque<Job> jobs;
+    };
+
+    void shutdown();
+    void workerLoop(size_t index);
+    bool tryRunOne(size_t self);
+    void run(Job& job);
+
+    std::vector<std::unique_ptr<WorkerQueue>> _queues;
+    std::vector<std::thread> _threads;
+    std::atomic<size_t> _queued{0};
+    std::atomic<bool> _running{false};
+    std::mutex _sleepMtx;
+    std::condition_variable _sleepCv;
+};
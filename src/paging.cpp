@@ -0,0 +1,385 @@
+#include "common.hpp"
+#include "wsim.hpp"
+
+// how often to look for chunks to evict, and how long a chunk has to sit
+// untouched before it can be
+const static uint64_t PAGING_INTERVAL = 30;
+const static uint64_t MIN_IDLE_TICKS = 60;
+
+// A page holds one chunk:
+//   uint32 offset of the entity section
+//   terrain
+//   uint32 tile count, then (uint16 tx, uint16 ty, uint64 bits) per blocked tile
+//   uint32 entity count, then per entity:
+//     handle, component mask, position, uint32 blob size, component blobs
+//     in ComponentId order
+
+void World::setMemoryBudget(size_t bytes)
+{
+    _memoryBudget = bytes;
+}
+
+bool World::isPaging() const
+{
+    if (_memoryBudget != 0)
+        return true;
+    for (auto& p : _pages) {
+        if (!_chunks[p.first].load(memory_order_acquire))
+            return true;
+    }
+    return false;
+}
+
+void World::setPageFile(const string& path)
+{
+    lock_guard<mutex> lck(_fileMtx);
+    if (_pageFile.is_open())
+        throw std::runtime_error("Page file can't be changed once chunks are paged out");
+    _pagePath = path;
+}
+
+// Start reading the chunk containing (x, y) in the background if it's
+// paged out, so it's ready by the time something steps into it.
+void World::prefetch(int x, int y)
+{
+    if (x >= static_cast<int>(_width) || y >= static_cast<int>(_height) || x < 0 || y < 0)
+        return;
+
+    uint32_t idx = chunkIndex(x, y);
+    if (_chunks[idx].load(memory_order_acquire))
+        return;
+
+    auto it = _pages.find(idx);
+    if (it == _pages.end())
+        return;
+
+    ChunkPage& page = it->second;
+    {
+        lock_guard<mutex> lck(_pageMtx);
+        if (page.state != PageState::PagedOut)
+            return;
+        page.state = PageState::Loading;
+        _pagingStats.prefetches++;
+    }
+
+    JOBS->submit(&_prefetchJobs, [this, &page]() {
+        vector<char> bytes = readPage(page);
+        lock_guard<mutex> lck(_pageMtx);
+        // chunkAt() may have beaten us to it
+        if (page.state == PageState::Loading) {
+            page.data = std::move(bytes);
+            page.state = PageState::Loaded;
+        }
+    });
+}
+
+// Slow path of chunkAt(): generate the chunk, or bring it back from the
+// page file. Safe to call from systems; the entities' components are put
+// back at the next tick boundary.
+WorldChunk& World::loadChunk(uint32_t idx)
+{
+    // _pages only changes shape in updatePaging(), between ticks
+    auto it = _pages.find(idx);
+    if (it == _pages.end())
+        return materializeChunk(idx);
+
+    lock_guard<mutex> lck(_pageMtx);
+    WorldChunk* chunk = _chunks[idx].load(memory_order_acquire);
+    if (chunk)
+        return *chunk;
+
+    ChunkPage& page = it->second;
+    if (page.state == PageState::Loaded)
+    {
+        _pagingStats.hits++;
+        return installChunk(idx, std::move(page.data));
+    }
+
+    auto t0 = high_resolution_clock::now();
+    vector<char> bytes = readPage(page);
+    _pagingStats.stallSeconds += duration_cast<duration<double>>(high_resolution_clock::now() - t0).count();
+    _pagingStats.misses++;
+    return installChunk(idx, std::move(bytes));
+}
+
+// Builds the chunk from a page and makes it visible. Needs _pageMtx.
+// The page is kept until the components can be restored.
+WorldChunk& World::installChunk(uint32_t idx, vector<char> bytes)
+{
+    WorldChunk* chunk = chunkFromPage(bytes.data());
+    chunk->lastAccess = _tick;
+    _pendingRestore.emplace_back(idx, std::move(bytes));
+    _pages[idx].state = PageState::Resident;
+    _pagingStats.pageIns++;
+
+    _chunks[idx].store(chunk, memory_order_release);
+    return *chunk;
+}
+
+// The chunk stored in a page, with its entities placed but their
+// components left in the page for restoreComponents(). Entities destroyed
+// while it was paged out are dropped.
+WorldChunk* World::chunkFromPage(const char* in)
+{
+    unique_ptr<WorldChunk> chunk(new WorldChunk);
+
+    uint32_t entityOffset;
+    readBytes(in, entityOffset);
+    chunk->readTiles(in);
+
+    uint32_t count;
+    readBytes(in, count);
+    chunk->entities.reserve(count);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        EntityHandle h;
+        ComponentMask mask;
+        Position pos;
+        uint32_t size;
+        readBytes(in, h);
+        readBytes(in, mask);
+        readBytes(in, pos);
+        readBytes(in, size);
+        in += size;
+
+        uint32_t cx = pos.x % CHUNK_SIZE;
+        uint32_t cy = pos.y % CHUNK_SIZE;
+        if (!EM->isValid(h)) {
+            chunk->blocked.set(cx, cy, false);
+            continue;
+        }
+        chunk->entities.push_back(h);
+        chunk->spatial.insert(h, pos.x, pos.y);
+        chunk->occupancy.insert(WorldChunk::cellIndex(pos.x, pos.y), h);
+    }
+    return chunk.release();
+}
+
+// Hands the components stored in a page back to their entities.
+void World::restoreComponents(const char* page)
+{
+    const char* in = page;
+    uint32_t entityOffset;
+    readBytes(in, entityOffset);
+    in = page + entityOffset;
+
+    auto& table = CMT->getTable();
+    uint32_t count;
+    readBytes(in, count);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        EntityHandle h;
+        ComponentMask mask;
+        Position pos;
+        uint32_t size;
+        readBytes(in, h);
+        readBytes(in, mask);
+        readBytes(in, pos);
+        readBytes(in, size);
+
+        bool discard = !EM->isValid(h);
+        for (auto& p : table) {
+            if (mask & componentBit(p.first))
+                p.second->readComponent(h, in, discard);
+        }
+        if (!discard) {
+            EM->getEntity(h)->components = mask;
+            EM->markChanged();
+        }
+    }
+}
+
+// Writes the chunk and its entities' components out, then frees them.
+// Only call between ticks.
+void World::pageOut(uint32_t idx)
+{
+    WorldChunk* chunk = _chunks[idx].load(memory_order_acquire);
+    vector<char> bytes;
+    writeBytes(bytes, uint32_t(0));
+    chunk->writeTiles(bytes);
+
+    uint32_t entityOffset = static_cast<uint32_t>(bytes.size());
+    memcpy(&bytes[0], &entityOffset, sizeof(entityOffset));
+
+    auto& table = CMT->getTable();
+    writeBytes(bytes, static_cast<uint32_t>(chunk->entities.size()));
+    for (const EntityHandle& h : chunk->entities)
+    {
+        Entity* e = EM->getEntity(h);
+        writeBytes(bytes, h);
+        writeBytes(bytes, e->components);
+        writeBytes(bytes, CM(PositionData)->getComponentRO(h)->pos);
+
+        size_t sizeAt = bytes.size();
+        writeBytes(bytes, uint32_t(0));
+        for (auto& p : table) {
+            if (e->components & componentBit(p.first)) {
+                p.second->writeComponent(h, bytes);
+                p.second->destroyComponent(h);
+            }
+        }
+        uint32_t size = static_cast<uint32_t>(bytes.size() - sizeAt - sizeof(uint32_t));
+        memcpy(&bytes[sizeAt], &size, sizeof(size));
+        e->components = 0;
+        EM->markChanged();
+    }
+
+    ChunkPage& page = _pages[idx];
+    writePage(page, bytes);
+    page.state = PageState::PagedOut;
+    _pagingStats.pageOuts++;
+
+    _chunks[idx].store(nullptr, memory_order_release);
+    delete chunk;
+}
+
+// A copy of a paged-out chunk's page, from a finished prefetch if there is
+// one or else from the page file, leaving the chunk paged out.
+vector<char> World::pageBytes(ChunkPage& page)
+{
+    {
+        lock_guard<mutex> lck(_pageMtx);
+        if (page.state == PageState::Loaded)
+            return page.data;
+    }
+    return readPage(page);
+}
+
+vector<char> World::readPage(const ChunkPage& page)
+{
+    vector<char> bytes(page.size);
+    lock_guard<mutex> lck(_fileMtx);
+    _pageFile.seekg(page.offset);
+    _pageFile.read(bytes.data(), page.size);
+    if (!_pageFile)
+        throw std::runtime_error("Failed to read chunk from " + _pagePath);
+    return bytes;
+}
+
+// Reuses the page's old slot in the file if the chunk still fits in it.
+void World::writePage(ChunkPage& page, const vector<char>& bytes)
+{
+    lock_guard<mutex> lck(_fileMtx);
+    if (!_pageFile.is_open()) {
+        _pageFile.open(_pagePath, ios::in | ios::out | ios::binary | ios::trunc);
+        if (!_pageFile)
+            throw std::runtime_error("Failed to open page file " + _pagePath);
+    }
+
+    if (bytes.size() > page.capacity) {
+        page.offset = _pageFileEnd;
+        page.capacity = static_cast<uint32_t>(bytes.size());
+        _pageFileEnd += page.capacity;
+    }
+    page.size = static_cast<uint32_t>(bytes.size());
+
+    _pageFile.seekp(page.offset);
+    _pageFile.write(bytes.data(), bytes.size());
+    if (!_pageFile)
+        throw std::runtime_error("Failed to write chunk to " + _pagePath);
+}
+
+static vector<size_t> componentSizes()
+{
+    vector<size_t> sizes(sizeof(ComponentMask) * 8, 0);
+    for (auto& p : CMT->getTable())
+        sizes[static_cast<size_t>(p.first)] = p.second->componentSize();
+    return sizes;
+}
+
+// the chunk's own data plus its entities' components
+static size_t chunkMemory(const WorldChunk& chunk, const vector<size_t>& componentSize)
+{
+    size_t total = chunk.memoryUsage();
+    for (const EntityHandle& h : chunk.entities) {
+        for (ComponentMask m = EM->getEntity(h)->components; m; m &= m - 1)
+            total += componentSize[ctz64(m)];
+    }
+    return total;
+}
+
+size_t World::residentMemory()
+{
+    vector<size_t> sizes = componentSizes();
+    size_t total = 0;
+    for (uint32_t i = 0; i < getNumChunks(); ++i)
+    {
+        WorldChunk* chunk = _chunks[i].load(memory_order_relaxed);
+        if (chunk)
+            total += chunkMemory(*chunk, sizes);
+    }
+    return total;
+}
+
+// Called by Game::tick between ticks, once tick is the world's clock:
+// finishes page-ins that happened during the tick, and pages out the least
+// recently used chunks while over budget.
+void World::updatePaging(uint64_t tick)
+{
+    // Without worker threads, queued prefetches only run when someone
+    // waits, and newer jobs always go first; do them here rather than let
+    // them turn into stalls.
+    if (JOBS->getNumWorkers() == 1)
+        JOBS->wait(&_prefetchJobs);
+
+    lock_guard<mutex> lck(_pageMtx);
+
+    // Finished prefetches stay put until something touches the chunk, and
+    // restores go in chunk order, so how fast the reads were can't change
+    // the simulation.
+    std::sort(_pendingRestore.begin(), _pendingRestore.end(),
+        [](const PendingRestore& a, const PendingRestore& b) { return a.first < b.first; });
+    for (const PendingRestore& r : _pendingRestore)
+        restoreComponents(r.second.data());
+    _pendingRestore.clear();
+
+    if (_memoryBudget == 0 || tick % PAGING_INTERVAL != 0)
+        return;
+
+    size_t used = residentMemory();
+    if (used <= _memoryBudget)
+        return;
+
+    // oldest first
+    vector<pair<uint64_t, uint32_t>> candidates;
+    for (uint32_t i = 0; i < getNumChunks(); ++i)
+    {
+        WorldChunk* chunk = _chunks[i].load(memory_order_relaxed);
+        if (chunk && chunk->lastAccess + MIN_IDLE_TICKS <= tick)
+            candidates.emplace_back(chunk->lastAccess.load(), i);
+    }
+    std::sort(candidates.begin(), candidates.end());
+
+    vector<size_t> sizes = componentSizes();
+    for (auto& c : candidates)
+    {
+        if (used <= _memoryBudget)
+            break;
+
+        size_t freed = chunkMemory(*_chunks[c.second].load(memory_order_relaxed), sizes);
+        pageOut(c.second);
+        used -= std::min(used, freed);
+    }
+}
+
+void World::prepareForFork()
+{
+    JOBS->wait(&_prefetchJobs);
+
+    lock_guard<mutex> lck(_fileMtx);
+    if (_pageFile.is_open())
+        _pageFile.flush();
+}
+
+void World::reopenPageFile()
+{
+    lock_guard<mutex> lck(_fileMtx);
+    if (!_pageFile.is_open())
+        return;
+
+    // nothing is buffered after prepareForFork(), so closing writes nothing
+    _pageFile.close();
+    _pageFile.open(_pagePath, ios::in | ios::out | ios::binary);
+    if (!_pageFile)
+        throw std::runtime_error("Failed to reopen page file " + _pagePath);
+}
@@ -0,0 +1,102 @@
+#include <new>
+#include "patharena.hpp"
+
+PathArena* PathArena::getSingleton()
+{
+    static unique_ptr<PathArena> instance;
+    if (!instance)
+        instance.reset(new PathArena);
+    return instance.get();
+}
+
+PathArena::PathArena() : _blocks(new unique_ptr<Segment[]>[MAX_BLOCKS])
+{
+    for (size_t i = 0; i < JOBS->getNumWorkers(); ++i)
+        _workers.emplace_back(new Worker);
+}
+
+PathCursor PathArena::store(const uint8_t* steps, size_t count)
+{
+    PathCursor c;
+    if (count == 0)
+        return c;
+
+    Worker& w = *_workers[JobSystem::currentWorker()];
+    size_t segments = (count + STEPS_PER_SEGMENT - 1) / STEPS_PER_SEGMENT;
+    PathHandle* link = &c.segment;
+    for (size_t i = 0; i < count; i += STEPS_PER_SEGMENT)
+    {
+        PathHandle h = allocate(w);
+        *link = h;
+
+        Segment& s = segment(h);
+        size_t n = std::min(count - i, STEPS_PER_SEGMENT);
+        std::fill(s.steps, s.steps + sizeof(s.steps), 0);
+        for (size_t j = 0; j < n; ++j)
+            s.steps[j / 2] |= steps[i + j] << (j % 2 * 4);
+        s.next = INVALID_PATH;
+        link = &s.next;
+    }
+
+    c.left = static_cast<uint32_t>(count);
+    _inUse += segments;
+    return c;
+}
+
+PathHandle PathArena::allocate(Worker& w)
+{
+    if (w.free == INVALID_PATH)
+        refill(w);
+    PathHandle h = w.free;
+    w.free = segment(h).next;
+    return h;
+}
+
+// moves a batch of segments from the pool to w, carving new ones if the
+// pool runs dry
+void PathArena::refill(Worker& w)
+{
+    std::lock_guard<std::mutex> lck(_mtx);
+    for (size_t i = 0; i < REFILL_SEGMENTS; ++i)
+    {
+        PathHandle h = _free;
+        if (h != INVALID_PATH) {
+            _free = segment(h).next;
+        }
+        else {
+            if (_numBlocks == 0 || _carved == SEGMENTS_PER_BLOCK) {
+                if (_numBlocks == MAX_BLOCKS)
+                    throw std::bad_alloc();
+                _blocks[_numBlocks++].reset(new Segment[SEGMENTS_PER_BLOCK]);
+                _carved = 0;
+            }
+            h = static_cast<PathHandle>((_numBlocks - 1) * SEGMENTS_PER_BLOCK + _carved++);
+        }
+        segment(h).next = w.free;
+        w.free = h;
+    }
+}
+
+void PathArena::collect()
+{
+    while (_workers.size() < JOBS->getNumWorkers())
+        _workers.emplace_back(new Worker);
+
+    size_t freed = 0;
+    for (auto& w : _workers)
+    {
+        for (PathHandle chain : w->retired)
+        {
+            PathHandle tail = chain;
+            freed++;
+            while (segment(tail).next != INVALID_PATH) {
+                tail = segment(tail).next;
+                freed++;
+            }
+            segment(tail).next = _free;
+            _free = chain;
+        }
+        w->retired.clear();
+    }
+    _inUse -= freed;
+}
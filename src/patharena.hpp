@@ -0,0 +1,163 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include "jobs.hpp"
+using std::vector;
+using std::unique_ptr;
+using std::mutex;
+using std::atomic;
+
+#define PATHS PathArena::getSingleton()
+
+typedef uint32_t PathHandle;
+const static PathHandle INVALID_PATH = 0xFFFFFFFF;
+
+// A step moves at most one tile along each axis, so it packs into 4 bits.
+inline uint8_t packStep(int dx, int dy)
+{
+    return static_cast<uint8_t>((dy + 1) * 3 + dx + 1);
+}
+
+inline void unpackStep(uint8_t step, int& dx, int& dy)
+{
+    dx = step % 3 - 1;
+    dy = step / 3 - 1;
+}
+
+// how far along a stored path its reader is
+struct PathCursor
+{
+    PathHandle segment = INVALID_PATH;  // holding the next step
+    uint32_t index = 0;                 // of the next step within it
+    uint32_t left = 0;                  // steps left, in all segments
+
+    bool empty() const { return left == 0; }
+
+    // as PathArena::release() leaves it, so releasing again changes nothing
+    bool released() const { return segment == INVALID_PATH && index == 0 && left == 0; }
+};
+
+// Paths, stored as packed steps in a chain of fixed-size segments drawn
+// from a shared pool, so a path costs a few bytes per step and no heap
+// allocation once the pool has warmed up.
+//
+// Each worker keeps its own free segments, topped up from the pool in
+// batches, so storing paths from several threads at once rarely locks.
+// Released segments aren't reused until collect() returns them to the
+// pool at the end of the tick, so releasing never locks either.
+class PathArena
+{
+public:
+    const static size_t STEPS_PER_SEGMENT = 56;
+
+    static PathArena* getSingleton();
+
+    PathArena();
+
+    // Stores count steps, each from packStep(), and returns a cursor at
+    // the first. Thread safe.
+    PathCursor store(const uint8_t* steps, size_t count);
+
+    // the next step, or false if there are none left
+    bool peek(const PathCursor& c, int& dx, int& dy) const
+    {
+        if (c.left == 0)
+            return false;
+        const Segment& s = segment(c.segment);
+        unpackStep((s.steps[c.index / 2] >> (c.index % 2 * 4)) & 0xF, dx, dy);
+        return true;
+    }
+
+    // Moves past the next step, releasing its segment once it's used up.
+    // Thread safe, as long as nobody else has c.
+    void advance(PathCursor& c)
+    {
+        if (c.left == 0)
+            return;
+        if (--c.left == 0) {
+            release(c);
+            return;
+        }
+        if (++c.index == STEPS_PER_SEGMENT) {
+            PathHandle used = c.segment;
+            c.segment = segment(used).next;
+            c.index = 0;
+            segment(used).next = INVALID_PATH;
+            retire(used);
+        }
+    }
+
+    // calls fn(step) for each step left, packed
+    template<typename Fn>
+    void forEach(const PathCursor& c, Fn fn) const
+    {
+        PathHandle h = c.segment;
+        size_t i = c.index;
+        for (size_t n = 0; n < c.left; ++n)
+        {
+            if (i == STEPS_PER_SEGMENT) {
+                h = segment(h).next;
+                i = 0;
+            }
+            fn(static_cast<uint8_t>((segment(h).steps[i / 2] >> (i % 2 * 4)) & 0xF));
+            i++;
+        }
+    }
+
+    // Drops the rest of the path and empties c. Thread safe.
+    void release(PathCursor& c)
+    {
+        if (c.segment != INVALID_PATH)
+            retire(c.segment);
+        c = PathCursor();
+    }
+
+    // Returns everything released since the last call to the pool. Call
+    // at the end of the tick, while nothing else uses the arena.
+    void collect();
+
+    size_t getSegmentsInUse() const { return _inUse; }
+    size_t getBytesReserved() const { return _numBlocks * SEGMENTS_PER_BLOCK * sizeof(Segment); }
+
+private:
+    const static size_t SEGMENTS_PER_BLOCK = 4096;
+    const static size_t MAX_BLOCKS = 1 << 16;
+    const static size_t REFILL_SEGMENTS = 64;
+
+    struct Segment
+    {
+        PathHandle next;
+        uint8_t steps[STEPS_PER_SEGMENT / 2];
+    };
+
+    struct Worker
+    {
+        PathHandle free = INVALID_PATH;     // linked through Segment::next
+        vector<PathHandle> retired;         // chains released this tick
+    };
+
+    Segment& segment(PathHandle h) const
+    {
+        return _blocks[h / SEGMENTS_PER_BLOCK][h % SEGMENTS_PER_BLOCK];
+    }
+
+    void retire(PathHandle chain)
+    {
+        _workers[JobSystem::currentWorker()]->retired.push_back(chain);
+    }
+
+    PathHandle allocate(Worker& w);
+    void refill(Worker& w);
+
+    unique_ptr<unique_ptr<Segment[]>[]> _blocks;
+    size_t _numBlocks = 0;
+    size_t _carved = 0;                 // segments handed out of the last block
+    PathHandle _free = INVALID_PATH;    // the pool, linked through Segment::next
+    mutex _mtx;
+    vector<unique_ptr<Worker>> _workers;   // one per worker
+    atomic<size_t> _inUse{0};
+};
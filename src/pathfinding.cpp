@@ -0,0 +1,714 @@
+#include "pathfinding.hpp"
+
+const uint32_t Pathfinder::UNREACHABLE;
+
+// cost of the cheapest walk across open ground
+static uint32_t octile(int dx, int dy)
+{
+    uint32_t ax = static_cast<uint32_t>(std::abs(dx));
+    uint32_t ay = static_cast<uint32_t>(std::abs(dy));
+    uint32_t lo = std::min(ax, ay);
+    uint32_t hi = std::max(ax, ay);
+    return lo * DIAGONAL_COST + (hi - lo) * STRAIGHT_COST;
+}
+
+// diagonally until level with to on one axis, then straight
+static void straightLine(const Position& from, const Position& to, vector<Position>& out)
+{
+    Position p = from;
+    while (p.x != to.x || p.y != to.y)
+    {
+        p.x += (to.x > p.x) - (to.x < p.x);
+        p.y += (to.y > p.y) - (to.y < p.y);
+        out.push_back(p);
+    }
+}
+
+Pathfinder::Pathfinder(World& world) : _world(world)
+{
+    _chunksX = world.getWidth() / CHUNK_SIZE;
+    _chunksY = world.getHeight() / CHUNK_SIZE;
+    _graphs.reset(new atomic<ChunkGraph*>[world.getNumChunks()]);
+    for (uint32_t i = 0; i < world.getNumChunks(); ++i)
+        _graphs[i] = nullptr;
+    growScratch();
+}
+
+Pathfinder::~Pathfinder()
+{
+    for (uint32_t i = 0; i < _world.getNumChunks(); ++i)
+        delete _graphs[i].load();
+}
+
+PathfinderStats Pathfinder::getStats() const
+{
+    PathfinderStats stats;
+    stats.requests = _requests;
+    stats.direct = _direct;
+    stats.hierarchical = _hierarchical;
+    stats.failed = _failed;
+    stats.graphsBuilt = _graphsBuilt;
+    return stats;
+}
+
+// One per worker, in case the pool was restarted with more. No search
+// window is bigger than a chunk.
+void Pathfinder::growScratch()
+{
+    while (_scratch.size() < JOBS->getNumWorkers())
+    {
+        _scratch.emplace_back(new Scratch);
+        _scratch.back()->stamp.assign(CHUNK_SIZE * CHUNK_SIZE, 0);
+        _scratch.back()->g.resize(CHUNK_SIZE * CHUNK_SIZE);
+        _scratch.back()->parent.resize(CHUNK_SIZE * CHUNK_SIZE);
+    }
+}
+
+void Pathfinder::refresh()
+{
+    growScratch();
+    for (uint32_t idx = 0; idx < _world.getNumChunks(); ++idx)
+    {
+        ChunkGraph* g = _graphs[idx].load(memory_order_relaxed);
+        if (!g)
+            continue;
+
+        uint32_t now[5];
+        versions(idx, now);
+        if (memcmp(now, g->versions, sizeof(now)) != 0) {
+            delete g;
+            _graphs[idx] = nullptr;
+        }
+    }
+}
+
+// A graph depends on the walls on both sides of its borders, so it goes
+// stale when its neighbours' walls change too.
+void Pathfinder::versions(uint32_t idx, uint32_t* out) const
+{
+    out[0] = _world.getWallVersion(idx);
+    for (int side = Left; side <= Bottom; ++side)
+    {
+        uint32_t n;
+        out[1 + side] = neighbour(idx, static_cast<Side>(side), n) ? _world.getWallVersion(n) : 0;
+    }
+}
+
+bool Pathfinder::neighbour(uint32_t idx, Side side, uint32_t& out) const
+{
+    uint32_t cx = idx % _chunksX;
+    uint32_t cy = idx / _chunksX;
+    switch (side)
+    {
+    case Left:
+        if (cx == 0)
+            return false;
+        out = idx - 1;
+        return true;
+    case Right:
+        if (cx + 1 >= _chunksX)
+            return false;
+        out = idx + 1;
+        return true;
+    case Top:
+        if (cy == 0)
+            return false;
+        out = idx - _chunksX;
+        return true;
+    case Bottom:
+        if (cy + 1 >= _chunksY)
+            return false;
+        out = idx + _chunksX;
+        return true;
+    }
+    return false;
+}
+
+Pathfinder::Window Pathfinder::chunkWindow(uint32_t idx) const
+{
+    int x0 = static_cast<int>((idx % _chunksX) * CHUNK_SIZE);
+    int y0 = static_cast<int>((idx / _chunksX) * CHUNK_SIZE);
+    return Window{ x0, y0, x0 + static_cast<int>(CHUNK_SIZE), y0 + static_cast<int>(CHUNK_SIZE) };
+}
+
+Position Pathfinder::portalPosition(uint32_t idx, uint16_t cell) const
+{
+    Window w = chunkWindow(idx);
+    return Position{ w.x0 + static_cast<int>(cell % CHUNK_SIZE), w.y0 + static_cast<int>(cell / CHUNK_SIZE), 0 };
+}
+
+Pathfinder::ChunkGraph& Pathfinder::graph(uint32_t idx)
+{
+    ChunkGraph* g = _graphs[idx].load(memory_order_acquire);
+    return g ? *g : *buildGraph(idx);
+}
+
+// Walls and portals. Generates or pages in the chunk and its neighbours if
+// it has to.
+Pathfinder::ChunkGraph* Pathfinder::buildGraph(uint32_t idx)
+{
+    lock_guard<mutex> lck(_buildMtx[idx % 16]);
+    ChunkGraph* g = _graphs[idx].load(memory_order_acquire);
+    if (g)
+        return g;
+
+    g = new ChunkGraph;
+    versions(idx, g->versions);
+    g->open.assign((CHUNK_SIZE * CHUNK_SIZE + 63) / 64, 0);
+
+    Window w = chunkWindow(idx);
+    const WorldChunk& chunk = _world.chunkAt(w.x0, w.y0);
+    for (uint32_t y = 0; y < CHUNK_SIZE; ++y)
+    {
+        chunk.terrain.forEachRun(y, [&](uint32_t x0, uint32_t x1, Terrain t) {
+            if (t.type == TerrainType::Wall) {
+                g->clear = false;
+                return;
+            }
+            for (uint32_t x = x0; x < x1; ++x)
+            {
+                uint32_t cell = y * CHUNK_SIZE + x;
+                g->open[cell / 64] |= 1ULL << (cell % 64);
+            }
+        });
+    }
+
+    if (!g->clear)
+        addRegions(*g);
+    for (int side = Left; side <= Bottom; ++side)
+        addPortals(*g, idx, static_cast<Side>(side));
+
+    _graphs[idx].store(g, memory_order_release);
+    _graphsBuilt++;
+    return g;
+}
+
+// Flood fills the open tiles. A diagonal step needs both tiles beside it
+// open, so steps along the grid are enough to tell what's connected.
+void Pathfinder::addRegions(ChunkGraph& g)
+{
+    const uint16_t NONE = numeric_limits<uint16_t>::max();
+    g.regions.assign(CHUNK_SIZE * CHUNK_SIZE, NONE);
+
+    uint16_t next = 0;
+    vector<uint32_t> stack;
+    for (uint32_t first = 0; first < CHUNK_SIZE * CHUNK_SIZE; ++first)
+    {
+        if (!g.isOpen(first) || g.regions[first] != NONE)
+            continue;
+
+        g.regions[first] = next;
+        stack.push_back(first);
+        while (!stack.empty())
+        {
+            uint32_t cell = stack.back();
+            stack.pop_back();
+            uint32_t x = cell % CHUNK_SIZE;
+            uint32_t y = cell / CHUNK_SIZE;
+            uint32_t around[4] = {
+                x > 0 ? cell - 1 : cell,
+                x + 1 < CHUNK_SIZE ? cell + 1 : cell,
+                y > 0 ? cell - CHUNK_SIZE : cell,
+                y + 1 < CHUNK_SIZE ? cell + CHUNK_SIZE : cell,
+            };
+            for (uint32_t n : around)
+            {
+                if (g.isOpen(n) && g.regions[n] == NONE) {
+                    g.regions[n] = next;
+                    stack.push_back(n);
+                }
+            }
+        }
+        next++;
+    }
+}
+
+// Splits each stretch of border that's open on both sides into pieces of
+// at most PORTAL_SPACING tiles, with a portal in the middle of each. The
+// chunk across the border does the same from its side, so the portals
+// line up in pairs.
+void Pathfinder::addPortals(ChunkGraph& g, uint32_t idx, Side side)
+{
+    uint32_t n;
+    if (!neighbour(idx, side, n))
+        return;
+
+    Window nw = chunkWindow(n);
+    const WorldChunk& other = _world.chunkAt(nw.x0, nw.y0);
+    const uint32_t last = CHUNK_SIZE - 1;
+
+    // tile i along the border on this side, and whether the one facing it
+    // on the other side is open
+    auto here = [&](uint32_t i) -> uint32_t {
+        switch (side)
+        {
+        case Left: return i * CHUNK_SIZE;
+        case Right: return i * CHUNK_SIZE + last;
+        case Top: return i;
+        default: return last * CHUNK_SIZE + i;
+        }
+    };
+    auto across = [&](uint32_t i) -> bool {
+        switch (side)
+        {
+        case Left: return other.terrain(last, i).type != TerrainType::Wall;
+        case Right: return other.terrain(0, i).type != TerrainType::Wall;
+        case Top: return other.terrain(i, last).type != TerrainType::Wall;
+        default: return other.terrain(i, 0).type != TerrainType::Wall;
+        }
+    };
+
+    uint32_t i = 0;
+    while (i < CHUNK_SIZE)
+    {
+        if (!g.isOpen(here(i)) || !across(i)) {
+            ++i;
+            continue;
+        }
+
+        uint32_t start = i;
+        while (i < CHUNK_SIZE && g.isOpen(here(i)) && across(i))
+            ++i;
+
+        uint32_t len = i - start;
+        uint32_t pieces = (len + PORTAL_SPACING - 1) / PORTAL_SPACING;
+        for (uint32_t k = 0; k < pieces; ++k)
+        {
+            uint32_t a = start + k * len / pieces;
+            uint32_t b = start + (k + 1) * len / pieces;
+            g.portals.push_back(static_cast<uint16_t>(here((a + b) / 2)));
+            g.sides.push_back(side);
+        }
+    }
+}
+
+// the portal across the border from g's portal, as its chunk and index
+bool Pathfinder::twin(const ChunkGraph& g, size_t portal, uint32_t idx, uint32_t& other, size_t& out)
+{
+    if (!neighbour(idx, g.sides[portal], other))
+        return false;
+
+    uint32_t cx = g.portals[portal] % CHUNK_SIZE;
+    uint32_t cy = g.portals[portal] / CHUNK_SIZE;
+    Side facing;
+    switch (g.sides[portal])
+    {
+    case Left: cx = CHUNK_SIZE - 1; facing = Right; break;
+    case Right: cx = 0; facing = Left; break;
+    case Top: cy = CHUNK_SIZE - 1; facing = Bottom; break;
+    default: cy = 0; facing = Top; break;
+    }
+
+    uint16_t cell = static_cast<uint16_t>(cy * CHUNK_SIZE + cx);
+    const ChunkGraph& og = graph(other);
+    for (size_t j = 0; j < og.portals.size(); ++j)
+    {
+        if (og.portals[j] == cell && og.sides[j] == facing) {
+            out = j;
+            return true;
+        }
+    }
+    return false;
+}
+
+// The graph with the distances between its portals filled in. Those take
+// a search per portal, so they're only worked out for chunks a search
+// over the portals actually passes through.
+Pathfinder::ChunkGraph& Pathfinder::linkedGraph(Scratch& s, uint32_t idx)
+{
+    ChunkGraph& g = graph(idx);
+    if (g.linked.load(memory_order_acquire))
+        return g;
+
+    lock_guard<mutex> lck(_buildMtx[idx % 16]);
+    if (g.linked.load(memory_order_relaxed))
+        return g;
+
+    size_t n = g.portals.size();
+    vector<uint32_t> row;
+    g.dist.assign(n * n, UNREACHABLE);
+    for (size_t i = 0; i < n; ++i)
+    {
+        distances(s, idx, portalPosition(idx, g.portals[i]), row);
+        std::copy(row.begin(), row.end(), g.dist.begin() + i * n);
+    }
+    g.linked.store(true, memory_order_release);
+    return g;
+}
+
+bool Pathfinder::isOpen(int x, int y)
+{
+    if (x < 0 || y < 0 || x >= static_cast<int>(_world.getWidth()) || y >= static_cast<int>(_world.getHeight()))
+        return false;
+    return graph(_world.chunkIndex(x, y)).isOpen(WorldChunk::cellIndex(x, y));
+}
+
+// true if there are no walls anywhere in w
+bool Pathfinder::isClear(const Window& w)
+{
+    for (int cy = w.y0 / CHUNK_SIZE; cy <= (w.y1 - 1) / static_cast<int>(CHUNK_SIZE); ++cy)
+    {
+        for (int cx = w.x0 / CHUNK_SIZE; cx <= (w.x1 - 1) / static_cast<int>(CHUNK_SIZE); ++cx)
+        {
+            if (!graph(cy * _chunksX + cx).clear)
+                return false;
+        }
+    }
+    return true;
+}
+
+// Best-first search over the open tiles of w, starting at from. With a
+// goal it's A* and stops when it gets there; without one it's Dijkstra,
+// and stops once every cell in targets is settled or there's nowhere left
+// to go. Costs are left in s.g, for the cells stamped with s.generation.
+bool Pathfinder::expand(Scratch& s, const Window& w, const Position& from, const Position* to,
+    const vector<uint16_t>* targets)
+{
+    static const int dirs[8][2] = {
+        { 1, 0 }, { -1, 0 }, { 0, 1 }, { 0, -1 },
+        { 1, 1 }, { 1, -1 }, { -1, 1 }, { -1, -1 },
+    };
+
+    assert(static_cast<size_t>(w.width() * w.height()) <= s.g.size());
+    if (++s.generation == 0) {
+        std::fill(s.stamp.begin(), s.stamp.end(), 0);
+        s.generation = 1;
+    }
+
+    auto h = [&](int x, int y) -> uint32_t {
+        return to ? octile(to->x - x, to->y - y) : 0;
+    };
+    auto later = greater<pair<uint32_t, uint32_t>>();
+
+    // most windows are a single chunk; read its walls directly
+    const ChunkGraph* only = nullptr;
+    if (_world.chunkIndex(w.x0, w.y0) == _world.chunkIndex(w.x1 - 1, w.y1 - 1))
+        only = &graph(_world.chunkIndex(w.x0, w.y0));
+    auto open = [&](int x, int y) {
+        return only ? only->isOpen(WorldChunk::cellIndex(x, y)) : isOpen(x, y);
+    };
+
+    uint32_t start = w.cell(from.x, from.y);
+    uint32_t goal = to ? w.cell(to->x, to->y) : UNREACHABLE;
+    size_t remaining = targets ? targets->size() : 0;
+    s.stamp[start] = s.generation;
+    s.g[start] = 0;
+    s.parent[start] = start;
+    s.open.clear();
+    s.open.emplace_back(h(from.x, from.y), start);
+
+    while (!s.open.empty())
+    {
+        pop_heap(s.open.begin(), s.open.end(), later);
+        uint32_t f = s.open.back().first;
+        uint32_t cell = s.open.back().second;
+        s.open.pop_back();
+
+        int x = w.x0 + static_cast<int>(cell % w.width());
+        int y = w.y0 + static_cast<int>(cell / w.width());
+        if (f != s.g[cell] + h(x, y))
+            continue;   // superseded by a cheaper way here
+
+        if (cell == goal)
+            return true;
+        if (targets)
+        {
+            for (uint16_t t : *targets) {
+                if (t == cell)
+                    remaining--;
+            }
+            if (remaining == 0)
+                return true;
+        }
+
+        for (int d = 0; d < 8; ++d)
+        {
+            int nx = x + dirs[d][0];
+            int ny = y + dirs[d][1];
+            if (nx < w.x0 || ny < w.y0 || nx >= w.x1 || ny >= w.y1 || !open(nx, ny))
+                continue;
+
+            // no cutting corners past walls
+            uint32_t cost = STRAIGHT_COST;
+            if (d >= 4) {
+                if (!open(nx, y) || !open(x, ny))
+                    continue;
+                cost = DIAGONAL_COST;
+            }
+
+            uint32_t next = w.cell(nx, ny);
+            uint32_t g = s.g[cell] + cost;
+            if (s.stamp[next] == s.generation && s.g[next] <= g)
+                continue;
+
+            s.stamp[next] = s.generation;
+            s.g[next] = g;
+            s.parent[next] = cell;
+            s.open.emplace_back(g + h(nx, ny), next);
+            push_heap(s.open.begin(), s.open.end(), later);
+        }
+    }
+    return targets != nullptr;
+}
+
+// walking cost from from to each of chunk idx's portals, without leaving
+// the chunk
+void Pathfinder::distances(Scratch& s, uint32_t idx, const Position& from, vector<uint32_t>& out)
+{
+    ChunkGraph& g = graph(idx);
+    out.assign(g.portals.size(), UNREACHABLE);
+    if (g.clear)
+    {
+        for (size_t i = 0; i < g.portals.size(); ++i)
+        {
+            Position p = portalPosition(idx, g.portals[i]);
+            out[i] = octile(p.x - from.x, p.y - from.y);
+        }
+        return;
+    }
+
+    // only portals in the same region can be reached; a chunk's window
+    // cells are its own cell indices
+    uint16_t region = g.region(WorldChunk::cellIndex(from.x, from.y));
+    s.targets.clear();
+    for (uint16_t p : g.portals) {
+        if (g.region(p) == region)
+            s.targets.push_back(p);
+    }
+    if (s.targets.empty())
+        return;
+
+    expand(s, chunkWindow(idx), from, nullptr, &s.targets);
+    for (size_t i = 0; i < g.portals.size(); ++i)
+    {
+        if (g.region(g.portals[i]) == region && s.stamp[g.portals[i]] == s.generation)
+            out[i] = s.g[g.portals[i]];
+    }
+}
+
+// Whether a route from from to to could exist within limit: a flood over
+// the chunks' regions, joined where their portals pair up, that stays in
+// the chunks such a route could pass through. It's far cheaper than
+// looking for the route, so hopeless searches end early.
+bool Pathfinder::connected(Scratch& s, const Position& from, const Position& to, uint32_t limit)
+{
+    auto key = [](uint32_t idx, uint16_t region) { return (static_cast<uint64_t>(idx) << 16) | region; };
+    uint32_t startIdx = _world.chunkIndex(from.x, from.y);
+    uint32_t goalIdx = _world.chunkIndex(to.x, to.y);
+    uint64_t start = key(startIdx, graph(startIdx).region(WorldChunk::cellIndex(from.x, from.y)));
+    uint64_t goal = key(goalIdx, graph(goalIdx).region(WorldChunk::cellIndex(to.x, to.y)));
+
+    int reach = static_cast<int>(limit / STRAIGHT_COST / CHUNK_SIZE) + 1;
+    int cx = static_cast<int>(startIdx % _chunksX);
+    int cy = static_cast<int>(startIdx / _chunksX);
+
+    s.seen.clear();
+    s.queue.clear();
+    s.seen.insert(start);
+    s.queue.push_back(start);
+    for (size_t q = 0; q < s.queue.size(); ++q)
+    {
+        uint64_t node = s.queue[q];
+        if (node == goal)
+            return true;
+
+        uint32_t idx = static_cast<uint32_t>(node >> 16);
+        uint16_t region = static_cast<uint16_t>(node & 0xFFFF);
+        const ChunkGraph& g = graph(idx);
+        for (size_t i = 0; i < g.portals.size(); ++i)
+        {
+            uint32_t other;
+            size_t j;
+            if (g.region(g.portals[i]) != region || !twin(g, i, idx, other, j))
+                continue;
+            if (std::abs(static_cast<int>(other % _chunksX) - cx) > reach || std::abs(static_cast<int>(other / _chunksX) - cy) > reach)
+                continue;
+
+            const ChunkGraph& og = graph(other);
+            uint64_t next = key(other, og.region(og.portals[j]));
+            if (s.seen.insert(next).second)
+                s.queue.push_back(next);
+        }
+    }
+    return false;
+}
+
+// appends the steps from from to to, without leaving w
+bool Pathfinder::searchGrid(Scratch& s, const Window& w, const Position& from, const Position& to, vector<Position>& out)
+{
+    if (from.x == to.x && from.y == to.y)
+        return true;
+
+    if (isClear(w)) {
+        straightLine(from, to, out);
+        return true;
+    }
+
+    if (!expand(s, w, from, &to, nullptr))
+        return false;
+
+    size_t at = out.size();
+    uint32_t start = w.cell(from.x, from.y);
+    for (uint32_t cell = w.cell(to.x, to.y); cell != start; cell = s.parent[cell])
+        out.push_back(Position{ w.x0 + static_cast<int>(cell % w.width()), w.y0 + static_cast<int>(cell / w.width()), from.z });
+    std::reverse(out.begin() + at, out.end());
+    return true;
+}
+
+// A* over the portals, from the portals reachable from from inside its
+// chunk to those that reach to inside its chunk, then a local search
+// between each pair of portals on the route.
+bool Pathfinder::searchPortals(Scratch& s, const Position& from, const Position& to, uint32_t limit, vector<Position>& out)
+{
+    const uint64_t START = numeric_limits<uint64_t>::max() - 1;
+    const uint64_t GOAL = numeric_limits<uint64_t>::max();
+
+    uint32_t startIdx = _world.chunkIndex(from.x, from.y);
+    uint32_t goalIdx = _world.chunkIndex(to.x, to.y);
+    distances(s, startIdx, from, s.fromStart);
+    distances(s, goalIdx, to, s.toGoal);
+
+    auto later = greater<pair<uint32_t, uint64_t>>();
+    auto key = [](uint32_t idx, size_t portal) { return (static_cast<uint64_t>(idx) << 16) | portal; };
+    auto h = [&](const Position& p) { return octile(to.x - p.x, to.y - p.y); };
+
+    s.nodes.clear();
+    s.frontier.clear();
+    auto push = [&](uint64_t node, uint32_t g, uint64_t parent, uint32_t estimate) {
+        if (g + estimate > limit)
+            return;
+        Node& n = s.nodes.emplace(node, Node{ UNREACHABLE, 0, false }).first->second;
+        if (n.closed || n.g <= g)
+            return;
+        n.g = g;
+        n.parent = parent;
+        s.frontier.emplace_back(g + estimate, node);
+        push_heap(s.frontier.begin(), s.frontier.end(), later);
+    };
+
+    const ChunkGraph& sg = graph(startIdx);
+    for (size_t i = 0; i < sg.portals.size(); ++i)
+    {
+        if (s.fromStart[i] != UNREACHABLE)
+            push(key(startIdx, i), s.fromStart[i], START, h(portalPosition(startIdx, sg.portals[i])));
+    }
+
+    bool found = false;
+    while (!s.frontier.empty())
+    {
+        pop_heap(s.frontier.begin(), s.frontier.end(), later);
+        uint64_t node = s.frontier.back().second;
+        s.frontier.pop_back();
+        if (node == GOAL) {
+            found = true;
+            break;
+        }
+
+        Node& n = s.nodes[node];
+        if (n.closed)
+            continue;
+        n.closed = true;
+
+        uint32_t g = n.g;
+        uint32_t idx = static_cast<uint32_t>(node >> 16);
+        size_t i = node & 0xFFFF;
+        const ChunkGraph& cg = linkedGraph(s, idx);
+
+        if (idx == goalIdx && s.toGoal[i] != UNREACHABLE)
+            push(GOAL, g + s.toGoal[i], node, 0);
+
+        size_t count = cg.portals.size();
+        for (size_t j = 0; j < count; ++j)
+        {
+            uint32_t d = cg.dist[i * count + j];
+            if (j != i && d != UNREACHABLE)
+                push(key(idx, j), g + d, node, h(portalPosition(idx, cg.portals[j])));
+        }
+
+        // one step across the border, to the matching portal
+        uint32_t other;
+        size_t j;
+        if (twin(cg, i, idx, other, j))
+            push(key(other, j), g + STRAIGHT_COST, node, h(portalPosition(other, graph(other).portals[j])));
+    }
+
+    if (!found)
+        return false;
+
+    s.route.clear();
+    for (uint64_t node = s.nodes[GOAL].parent; node != START; node = s.nodes[node].parent)
+        s.route.push_back(node);
+    std::reverse(s.route.begin(), s.route.end());
+
+    // consecutive portals in one chunk are walked with a local search;
+    // otherwise they're the two sides of a border
+    Position at = from;
+    uint32_t atIdx = startIdx;
+    for (uint64_t node : s.route)
+    {
+        uint32_t idx = static_cast<uint32_t>(node >> 16);
+        Position p = portalPosition(idx, graph(idx).portals[node & 0xFFFF]);
+        if (idx != atIdx)
+            out.push_back(p);
+        else if (!searchGrid(s, chunkWindow(idx), at, p, out))
+            return false;
+        at = p;
+        atIdx = idx;
+    }
+    return searchGrid(s, chunkWindow(goalIdx), at, to, out);
+}
+
+bool Pathfinder::findPath(const Position& from, const Position& to, vector<Position>& out)
+{
+    _requests++;
+    out.clear();
+
+    Scratch& s = *_scratch[JobSystem::currentWorker()];
+    if (!isOpen(from.x, from.y) || !isOpen(to.x, to.y)) {
+        _failed++;
+        return false;
+    }
+
+    int dx = std::abs(to.x - from.x);
+    int dy = std::abs(to.y - from.y);
+    if (dx <= DIRECT_SEARCH_RANGE && dy <= DIRECT_SEARCH_RANGE)
+    {
+        // with some room around the two to get past whatever is between
+        const int margin = DIRECT_SEARCH_RANGE / 2;
+        Window w{
+            std::max(0, std::min(from.x, to.x) - margin),
+            std::max(0, std::min(from.y, to.y) - margin),
+            std::min(static_cast<int>(_world.getWidth()), std::max(from.x, to.x) + margin + 1),
+            std::min(static_cast<int>(_world.getHeight()), std::max(from.y, to.y) + margin + 1),
+        };
+        if (searchGrid(s, w, from, to, out)) {
+            _direct++;
+            return true;
+        }
+    }
+
+    uint32_t limit = PATH_DETOUR_LIMIT * octile(to.x - from.x, to.y - from.y) + CHUNK_SIZE * STRAIGHT_COST;
+    if (!connected(s, from, to, limit)) {
+        _failed++;
+        return false;
+    }
+
+    // the same region of the same chunk is certain to be reachable inside it
+    uint32_t fromIdx = _world.chunkIndex(from.x, from.y);
+    const ChunkGraph& g = graph(fromIdx);
+    if (fromIdx == _world.chunkIndex(to.x, to.y) &&
+        g.region(WorldChunk::cellIndex(from.x, from.y)) == g.region(WorldChunk::cellIndex(to.x, to.y)) &&
+        searchGrid(s, chunkWindow(fromIdx), from, to, out)) {
+        _direct++;
+        return true;
+    }
+
+    if (searchPortals(s, from, to, limit, out)) {
+        _hierarchical++;
+        return true;
+    }
+
+    out.clear();
+    _failed++;
+    return false;
+}
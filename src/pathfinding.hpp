@@ -0,0 +1,161 @@
+#pragma once
+
+#include <unordered_map>
+#include <unordered_set>
+#include "common.hpp"
+#include "wsim.hpp"
+
+// at most this far apart along one open stretch of chunk border
+const static uint32_t PORTAL_SPACING = 64;
+
+// start and goal at most this far apart are searched for directly on the
+// tile grid first
+const static int DIRECT_SEARCH_RANGE = 48;
+
+// A step costs this much straight and this much diagonally, which is
+// about 1.5 times as far.
+const static uint32_t STRAIGHT_COST = 2;
+const static uint32_t DIAGONAL_COST = 3;
+
+// A search over the portals gives up on routes longer than this many
+// times the straight-line cost plus a chunk's width, so a goal behind a
+// wall doesn't flood the whole world.
+const static uint32_t PATH_DETOUR_LIMIT = 4;
+
+// Hierarchical A* (HPA*) over the world's chunks. Each chunk gets a graph:
+// which of its tiles are walls, portals in the middle of each open
+// stretch of its borders, and the walking distance between every pair of
+// its portals. A long search runs A* over the portals, then walks each
+// chunk it passes through with a local search between the portals it
+// picked.
+//
+// Only walls count as obstacles. Other entities come and go every tick,
+// so working around them is left to whoever follows the path. A chunk's
+// graph is rebuilt only when the walls in it or on the far side of its
+// borders change.
+class Pathfinder
+{
+public:
+    Pathfinder(World& world);
+    ~Pathfinder();
+
+    // Tiles to walk from from to to, one step at a time, including to but
+    // not from. False if to can't be reached. Safe to call from several
+    // threads at once.
+    bool findPath(const Position& from, const Position& to, vector<Position>& out);
+
+    // Drops graphs whose walls have changed, and makes room for every
+    // worker's searches. Call while no searches run.
+    void refresh();
+
+    PathfinderStats getStats() const;
+
+private:
+    friend class FlowFields;
+
+    enum Side : uint8_t
+    {
+        Left,
+        Right,
+        Top,
+        Bottom,
+    };
+
+    const static uint32_t UNREACHABLE = numeric_limits<uint32_t>::max();
+
+    struct ChunkGraph
+    {
+        uint32_t versions[5];       // wall versions of the chunk and its neighbours, see versions()
+        bool clear = true;          // no walls at all
+        vector<uint64_t> open;      // bit per tile, set if it isn't a wall
+        vector<uint16_t> regions;   // per tile, which part of the chunk it's in; empty if clear
+        vector<uint16_t> portals;   // tile index within the chunk
+        vector<Side> sides;         // border each portal is on
+        vector<uint32_t> dist;      // portals x portals, filled in by linkedGraph()
+        atomic<bool> linked{false};
+
+        bool isOpen(uint32_t cell) const
+        {
+            return (open[cell / 64] >> (cell % 64)) & 1;
+        }
+
+        // Tiles in the same region can reach each other without leaving
+        // the chunk. Walls are in none.
+        uint16_t region(uint32_t cell) const
+        {
+            return clear ? 0 : regions[cell];
+        }
+    };
+
+    // a rectangle of tiles, [x0, x1) x [y0, y1)
+    struct Window
+    {
+        int x0;
+        int y0;
+        int x1;
+        int y1;
+
+        int width() const { return x1 - x0; }
+        int height() const { return y1 - y0; }
+        uint32_t cell(int x, int y) const { return (y - y0) * width() + (x - x0); }
+    };
+
+    // a portal in the abstract search
+    struct Node
+    {
+        uint32_t g;
+        uint64_t parent;
+        bool closed;
+    };
+
+    // per worker, so searches don't allocate
+    struct Scratch
+    {
+        vector<uint32_t> stamp;     // generation that last reached each window cell
+        vector<uint32_t> g;
+        vector<uint32_t> parent;
+        uint32_t generation = 0;
+        vector<pair<uint32_t, uint32_t>> open;  // (f, cell)
+        vector<uint16_t> targets;
+        vector<uint32_t> fromStart;
+        vector<uint32_t> toGoal;
+        unordered_set<uint64_t> seen;
+        vector<uint64_t> queue;
+        unordered_map<uint64_t, Node> nodes;
+        vector<pair<uint32_t, uint64_t>> frontier;  // (f, node)
+        vector<uint64_t> route;
+    };
+
+    ChunkGraph& graph(uint32_t idx);
+    ChunkGraph& linkedGraph(Scratch& s, uint32_t idx);
+    ChunkGraph* buildGraph(uint32_t idx);
+    void addRegions(ChunkGraph& g);
+    void addPortals(ChunkGraph& g, uint32_t idx, Side side);
+    bool twin(const ChunkGraph& g, size_t portal, uint32_t idx, uint32_t& other, size_t& out);
+    void growScratch();
+    void versions(uint32_t idx, uint32_t* out) const;
+    bool neighbour(uint32_t idx, Side side, uint32_t& out) const;
+    Window chunkWindow(uint32_t idx) const;
+    Position portalPosition(uint32_t idx, uint16_t cell) const;
+
+    bool isOpen(int x, int y);
+    bool isClear(const Window& w);
+    bool expand(Scratch& s, const Window& w, const Position& from, const Position* to, const vector<uint16_t>* targets);
+    void distances(Scratch& s, uint32_t idx, const Position& from, vector<uint32_t>& out);
+    bool connected(Scratch& s, const Position& from, const Position& to, uint32_t limit);
+    bool searchGrid(Scratch& s, const Window& w, const Position& from, const Position& to, vector<Position>& out);
+    bool searchPortals(Scratch& s, const Position& from, const Position& to, uint32_t limit, vector<Position>& out);
+
+    World& _world;
+    uint32_t _chunksX;
+    uint32_t _chunksY;
+    unique_ptr<atomic<ChunkGraph*>[]> _graphs;
+    mutex _buildMtx[16];
+    vector<unique_ptr<Scratch>> _scratch;   // one per worker
+
+    atomic<uint64_t> _requests{0};
+    atomic<uint64_t> _direct{0};
+    atomic<uint64_t> _hierarchical{0};
+    atomic<uint64_t> _failed{0};
+    atomic<uint64_t> _graphsBuilt{0};
+};
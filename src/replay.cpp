@@ -0,0 +1,404 @@
+#include "common.hpp"
+#include "wsim.hpp"
+#include "snapshot.hpp"
+
+const static uint32_t REPLAY_VERSION = 2;
+const static char REPLAY_MAGIC[4] = { 'W', 'S', 'L', 'G' };
+
+// Log layout:
+//   header
+//   per tick: record header, then its entries
+//   per entry: entry header, then size bytes of payload
+//
+// A section entry updates a snapshot section (the entity table or a
+// component pool), treated as an array of 64-bit words. Only the words
+// that changed are stored, as runs:
+//   varint words to skip, varint words stored, the stored words
+// Words outside the runs keep their value, and sections without an entry
+// didn't change. A terrain entry replaces one chunk's terrain wholesale.
+struct ReplayHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t baseTick;
+};
+
+struct ReplayRecord
+{
+    uint64_t tick;
+    uint32_t entries;
+    uint32_t bytes;     // of the entries that follow
+};
+
+enum class DeltaKind : uint8_t
+{
+    Section,
+    Terrain,
+};
+
+struct DeltaEntry
+{
+    DeltaKind kind;
+    uint8_t reserved[3];
+    uint32_t id;        // section id, or chunk index
+    uint64_t size;      // of the section or terrain after this tick
+    uint64_t bytes;     // of the payload that follows
+};
+
+static void writeVarint(vector<char>& out, uint64_t v)
+{
+    while (v >= 0x80) {
+        out.push_back(static_cast<char>(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back(static_cast<char>(v));
+}
+
+static uint64_t readVarint(const char*& in)
+{
+    uint64_t v = 0;
+    for (int shift = 0; ; shift += 7)
+    {
+        uint8_t b = static_cast<uint8_t>(*in++);
+        v |= static_cast<uint64_t>(b & 0x7F) << shift;
+        if (!(b & 0x80))
+            return v;
+    }
+}
+
+static uint64_t loadWord(const vector<char>& v, size_t i)
+{
+    uint64_t w;
+    memcpy(&w, &v[i * 8], 8);
+    return w;
+}
+
+static void storeWord(vector<char>& v, size_t i, uint64_t w)
+{
+    memcpy(&v[i * 8], &w, 8);
+}
+
+// Sections are padded to cache lines, so they're always whole words. The
+// state is resized the same way on both sides, new words starting at 0.
+static void resizeSection(vector<char>& section, size_t size)
+{
+    if (size % 8 != 0)
+        throw std::runtime_error("Replay section isn't a whole number of words");
+    section.resize(size, 0);
+}
+
+static void writeEntry(vector<char>& out, DeltaKind kind, uint32_t id, uint64_t size, uint64_t bytes)
+{
+    DeltaEntry entry{};
+    entry.kind = kind;
+    entry.id = id;
+    entry.size = size;
+    entry.bytes = bytes;
+    writeBytes(out, entry);
+}
+
+ReplayRecorder::ReplayRecorder(shared_ptr<World> world, const string& snapshotPath, const string& logPath)
+{
+    _world = world;
+    if (_world->isPaging())
+        throw std::runtime_error("Can't record a replay while paging is on");
+    _world->saveSnapshot(snapshotPath);
+
+    // start from exactly the sections in the base snapshot, and forget
+    // what was written before it
+    EM->writeSnapshot(_sections[0]);
+    EM->takeChanged();
+    for (auto& p : CMT->getTable())
+    {
+        p.second->writeSnapshot(_sections[static_cast<uint32_t>(p.first)]);
+        p.second->takeChanges([](size_t, const char*, size_t) {});
+    }
+
+    // terrain edits before this point are in the snapshot
+    uint32_t ignored = 0;
+    _world->recordTerrainChanges(_scratch, ignored);
+    _scratch.clear();
+
+    _log.open(logPath, ios::out | ios::binary | ios::trunc);
+    ReplayHeader header;
+    memcpy(header.magic, REPLAY_MAGIC, sizeof(header.magic));
+    header.version = REPLAY_VERSION;
+    header.baseTick = _world->getTick();
+    _log.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    if (!_log)
+        throw std::runtime_error("Failed to write replay log " + logPath);
+}
+
+void ReplayRecorder::record(uint64_t tick)
+{
+    auto t0 = high_resolution_clock::now();
+    if (_world->isPaging())
+        throw std::runtime_error("Can't record a replay while paging is on");
+
+    _record.clear();
+    _entries = 0;
+    writeBytes(_record, ReplayRecord{ tick, 0, 0 });
+
+    if (EM->takeChanged()) {
+        _scratch.clear();
+        EM->writeSnapshot(_scratch);
+        diff(0, _scratch);
+    }
+
+    for (auto& p : CMT->getTable())
+        diffChanges(static_cast<uint32_t>(p.first), p.second);
+
+    _world->recordTerrainChanges(_record, _entries);
+
+    ReplayRecord header{ tick, _entries, static_cast<uint32_t>(_record.size() - sizeof(ReplayRecord)) };
+    memcpy(&_record[0], &header, sizeof(header));
+
+    // a record is only ever appended whole, so a log cut short by a crash
+    // is still good up to its last complete tick
+    _log.write(_record.data(), _record.size());
+    _log.flush();
+    if (!_log)
+        throw std::runtime_error("Failed to write replay log");
+
+    _stats.ticks++;
+    _stats.bytes += _record.size();
+    _stats.seconds += duration_cast<duration<double>>(high_resolution_clock::now() - t0).count();
+}
+
+size_t ReplayRecorder::beginEntry(uint32_t id)
+{
+    size_t entryAt = _record.size();
+    writeEntry(_record, DeltaKind::Section, id, _sections[id].size(), 0);
+    _run.clear();
+    _runLast = 0;
+    return entryAt;
+}
+
+// drops the entry again if nothing in it changed
+void ReplayRecorder::endEntry(size_t entryAt, bool resized)
+{
+    flushRun();
+    uint64_t bytes = _record.size() - entryAt - sizeof(DeltaEntry);
+    if (bytes == 0 && !resized) {
+        _record.resize(entryAt);
+        return;
+    }
+    memcpy(&_record[entryAt + offsetof(DeltaEntry, bytes)], &bytes, sizeof(bytes));
+    _entries++;
+}
+
+// words come in increasing order
+void ReplayRecorder::addWord(size_t i, uint64_t word)
+{
+    if (!_run.empty() && i != _runStart + _run.size())
+        flushRun();
+    if (_run.empty())
+        _runStart = i;
+    _run.push_back(word);
+}
+
+void ReplayRecorder::flushRun()
+{
+    if (_run.empty())
+        return;
+    writeVarint(_record, _runStart - _runLast);
+    writeVarint(_record, _run.size());
+    writeBytes(_record, _run.data(), _run.size());
+    _runLast = _runStart + _run.size();
+    _run.clear();
+}
+
+// Appends an entry with the words of now that differ from the section,
+// and advances the section to now.
+void ReplayRecorder::diff(uint32_t id, const vector<char>& now)
+{
+    vector<char>& section = _sections[id];
+    bool resized = section.size() != now.size();
+    resizeSection(section, now.size());
+
+    size_t entryAt = beginEntry(id);
+    for (size_t i = 0; i < now.size() / 8; ++i)
+    {
+        uint64_t word = loadWord(now, i);
+        if (word != loadWord(section, i)) {
+            storeWord(section, i, word);
+            addWord(i, word);
+        }
+    }
+    endEntry(entryAt, resized);
+}
+
+// Only compares what the pool says was written since the last tick. When
+// it can't say, the pool is serialized and compared whole.
+void ReplayRecorder::diffChanges(uint32_t id, CMInterface* cm)
+{
+    vector<char>& section = _sections[id];
+    size_t entryAt = beginEntry(id);
+    bool ranges = cm->takeChanges([&](size_t offset, const char* bytes, size_t size) {
+        for (size_t i = offset / 8; i * 8 < offset + size; ++i)
+        {
+            // the ends of a range needn't be whole words
+            uint64_t word = loadWord(section, i);
+            size_t lo = max(i * 8, offset);
+            size_t hi = min(i * 8 + 8, offset + size);
+            memcpy(reinterpret_cast<char*>(&word) + (lo - i * 8), bytes + (lo - offset), hi - lo);
+            if (word != loadWord(section, i)) {
+                storeWord(section, i, word);
+                addWord(i, word);
+            }
+        }
+    });
+
+    if (ranges) {
+        endEntry(entryAt, false);
+        return;
+    }
+
+    _record.resize(entryAt);
+    _scratch.clear();
+    cm->writeSnapshot(_scratch);
+    diff(id, _scratch);
+}
+
+void World::recordTerrainChanges(vector<char>& out, uint32_t& entries)
+{
+    vector<char> bytes;
+    for (uint32_t i = 0; i < getNumChunks(); ++i)
+    {
+        WorldChunk* chunk = _chunks[i].load(memory_order_acquire);
+        if (!chunk || !chunk->terrainDirty)
+            continue;
+
+        bytes.clear();
+        chunk->terrain.serialize(bytes);
+        writeEntry(out, DeltaKind::Terrain, i, bytes.size(), bytes.size());
+        writeBytes(out, bytes.data(), bytes.size());
+        chunk->terrainDirty = false;
+        entries++;
+    }
+}
+
+shared_ptr<World> World::replay(const string& snapshotPath, const string& logPath, uint64_t tick,
+    ChunkGenerator generator)
+{
+    MappedFile file(snapshotPath);
+    const char* in = file.data();
+    SnapshotHeader header = readSnapshotHeader(file, in, snapshotPath);
+
+    // sections of the base snapshot, updated in place as the log is read
+    const char* end = file.data() + file.size();
+    map<uint32_t, vector<char>> sections;
+    for (uint32_t i = 0; i <= header.numComponents; ++i)
+    {
+        SnapshotSection section;
+        const char* payload = readSection(in, end, section);
+        sections[section.id].assign(payload, payload + section.size);
+    }
+
+    // the log only covers the pools, so entities whose components were
+    // paged out when the snapshot was taken can't be replayed
+    uint64_t numChunks;
+    const SnapshotChunk* dir = readChunkDirectory(file, in, header.width / CHUNK_SIZE * (header.height / CHUNK_SIZE),
+        numChunks, snapshotPath);
+    for (uint64_t i = 0; i < numChunks; ++i) {
+        if (dir[i].paged)
+            throw std::runtime_error("Can't replay on top of " + snapshotPath + ", which has paged-out chunks");
+    }
+
+    ifstream log(logPath, ios::in | ios::binary);
+    ReplayHeader logHeader;
+    log.read(reinterpret_cast<char*>(&logHeader), sizeof(logHeader));
+    if (!log || memcmp(logHeader.magic, REPLAY_MAGIC, sizeof(logHeader.magic)) != 0)
+        throw std::runtime_error("Not a replay log: " + logPath);
+    if (logHeader.version != REPLAY_VERSION)
+        throw std::runtime_error("Unsupported replay log version " + to_string(logHeader.version) + " in " + logPath);
+    if (logHeader.baseTick != header.tick)
+        throw std::runtime_error("Replay log " + logPath + " wasn't recorded on top of " + snapshotPath);
+
+    map<uint32_t, vector<char>> terrain;
+    uint64_t reached = header.tick;
+    vector<char> bytes;
+    ReplayRecord record;
+    while (reached < tick && log.read(reinterpret_cast<char*>(&record), sizeof(record)))
+    {
+        if (record.tick > tick)
+            break;
+
+        bytes.resize(record.bytes);
+        if (!log.read(bytes.data(), record.bytes))
+            break;  // cut short
+
+        const char* p = bytes.data();
+        for (uint32_t e = 0; e < record.entries; ++e)
+        {
+            DeltaEntry entry;
+            readBytes(p, entry);
+            const char* end = p + entry.bytes;
+            if (entry.kind == DeltaKind::Terrain) {
+                terrain[entry.id].assign(p, end);
+                p = end;
+                continue;
+            }
+
+            vector<char>& section = sections[entry.id];
+            resizeSection(section, entry.size);
+            size_t i = 0;
+            while (p < end)
+            {
+                i += readVarint(p);
+                size_t n = readVarint(p);
+                if (i + n > entry.size / 8)
+                    throw std::runtime_error("Corrupt replay log " + logPath);
+                readBytes(p, &section[i * 8], n * 8);
+                i += n;
+            }
+        }
+        reached = record.tick;
+    }
+
+    // this clears the EntityManager and every pool
+    shared_ptr<World> world = make_shared<World>(header.width, header.height, generator);
+    world->_tick = reached;
+
+    // the readers expect cache line aligned input
+    vector<char, AlignedAllocator<char>> aligned;
+    for (auto& s : sections)
+    {
+        aligned.assign(s.second.begin(), s.second.end());
+        const char* payload = aligned.data();
+        if (s.first == 0) {
+            EM->readSnapshot(payload);
+            continue;
+        }
+
+        CMInterface* cm = componentManager(static_cast<ComponentId>(s.first));
+        if (!cm)
+            throw std::runtime_error("Unknown component " + to_string(s.first) + " in " + snapshotPath);
+        cm->readSnapshot(payload);
+    }
+
+    // terrain from the snapshot or the log; everything else in the chunks
+    // follows from where the entities are
+    for (uint64_t i = 0; i < numChunks; ++i)
+    {
+        const char* p = file.data() + dir[i].offset;
+        WorldChunk* chunk = new WorldChunk;
+        chunk->readTiles(p);
+        chunk->blocked.clear();
+        chunk->lastAccess = reached;
+        world->_chunks[dir[i].index].store(chunk, memory_order_release);
+    }
+    for (auto& t : terrain)
+    {
+        const char* p = t.second.data();
+        WorldChunk* chunk = world->_chunks[t.first].load(memory_order_acquire);
+        if (!chunk)
+            chunk = &world->materializeChunk(t.first);
+        chunk->terrain.deserialize(p);
+    }
+
+    for (const PositionData& pd : poolOf<const PositionData>()->getData())
+        world->addEntity(EM->getEntity(pd.parent));
+
+    return world;
+}
@@ -0,0 +1,141 @@
+#include "common.hpp"
+#include "wsim.hpp"
+#include "snapshot.hpp"
+
+// Chunks are written one at a time, straight to the file. Paged-out ones
+// are copied from their pages as they are, so saving never brings the
+// world back into memory.
+void World::saveSnapshot(const string& path)
+{
+    auto& table = CMT->getTable();
+    vector<char> out;
+
+    SnapshotHeader header;
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.width = _width;
+    header.height = _height;
+    header.tick = _tick;
+    header.numComponents = static_cast<uint32_t>(table.size());
+    header.reserved = 0;
+    writeBytes(out, header);
+    padBytes(out, CACHE_LINE_SIZE);
+
+    writeSection(out, 0, [&](vector<char>& o) { EM->writeSnapshot(o); });
+    for (auto& p : table)
+        writeSection(out, static_cast<uint32_t>(p.first), [&](vector<char>& o) { p.second->writeSnapshot(o); });
+
+    // _pages only changes shape between ticks
+    vector<SnapshotChunk> dir;
+    for (uint32_t i = 0; i < getNumChunks(); ++i)
+    {
+        if (_chunks[i].load(memory_order_acquire))
+            dir.push_back(SnapshotChunk{ i, 0, 0, 0 });
+        else if (_pages.count(i))
+            dir.push_back(SnapshotChunk{ i, 1, 0, 0 });
+    }
+
+    writeBytes(out, static_cast<uint64_t>(dir.size()));
+    padBytes(out, CACHE_LINE_SIZE);
+    size_t dirAt = out.size();
+    out.resize(dirAt + dir.size() * sizeof(SnapshotChunk));
+    padBytes(out, CACHE_LINE_SIZE);
+
+    ofstream file(path, ios::out | ios::binary | ios::trunc);
+    file.write(out.data(), out.size());
+
+    uint64_t offset = out.size();
+    for (SnapshotChunk& entry : dir)
+    {
+        out.clear();
+        if (entry.paged) {
+            out = pageBytes(_pages[entry.index]);
+        }
+        else {
+            WorldChunk* chunk = _chunks[entry.index].load(memory_order_acquire);
+            chunk->writeTiles(out);
+            writeBytes(out, static_cast<uint32_t>(chunk->entities.size()));
+            writeBytes(out, chunk->entities.data(), chunk->entities.size());
+        }
+
+        entry.offset = offset;
+        entry.size = out.size();
+        file.write(out.data(), out.size());
+        offset += out.size();
+    }
+
+    file.seekp(dirAt);
+    file.write(reinterpret_cast<const char*>(dir.data()), dir.size() * sizeof(SnapshotChunk));
+    file.close();
+    if (!file)
+        throw std::runtime_error("Failed to write snapshot " + path);
+}
+
+shared_ptr<World> World::loadSnapshot(const string& path, ChunkGenerator generator)
+{
+    MappedFile file(path);
+    const char* in = file.data();
+    SnapshotHeader header = readSnapshotHeader(file, in, path);
+
+    // this clears the EntityManager and every pool
+    shared_ptr<World> world = make_shared<World>(header.width, header.height, generator);
+    world->_tick = header.tick;
+
+    const char* end = file.data() + file.size();
+    SnapshotSection section;
+    const char* payload = readSection(in, end, section);
+    EM->readSnapshot(payload);
+
+    for (uint32_t i = 0; i < header.numComponents; ++i)
+    {
+        payload = readSection(in, end, section);
+        CMInterface* cm = componentManager(static_cast<ComponentId>(section.id));
+        if (!cm)
+            throw std::runtime_error("Unknown component " + to_string(section.id) + " in " + path);
+        cm->readSnapshot(payload);
+    }
+
+    uint64_t numChunks;
+    const SnapshotChunk* dir = readChunkDirectory(file, in, world->getNumChunks(), numChunks, path);
+
+    // chunks are independent, and the spatial index and occupancy map are
+    // rebuilt from the positions that were just loaded, or the ones in the
+    // pages of chunks that were paged out
+    JOBS->parallelFor(0, numChunks, 8, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i)
+        {
+            const char* p = file.data() + dir[i].offset;
+            if (dir[i].paged) {
+                WorldChunk* chunk = chunkFromPage(p);
+                chunk->lastAccess = header.tick;
+                world->_chunks[dir[i].index].store(chunk, memory_order_release);
+                continue;
+            }
+
+            WorldChunk* chunk = new WorldChunk;
+            chunk->readTiles(p);
+
+            uint32_t count;
+            readBytes(p, count);
+            chunk->entities.resize(count);
+            readBytes(p, chunk->entities.data(), count);
+
+            for (const EntityHandle& h : chunk->entities)
+            {
+                const Position& pos = CM(PositionData)->getComponentRO(h)->pos;
+                chunk->spatial.insert(h, pos.x, pos.y);
+                chunk->occupancy.insert(WorldChunk::cellIndex(pos.x, pos.y), h);
+            }
+            chunk->lastAccess = header.tick;
+            world->_chunks[dir[i].index].store(chunk, memory_order_release);
+        }
+    });
+
+    // pools can't be filled from several threads
+    for (uint64_t i = 0; i < numChunks; ++i) {
+        if (dir[i].paged)
+            world->restoreComponents(file.data() + dir[i].offset);
+    }
+
+    return world;
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+// Snapshot file format, shared by snapshots and the replay log.
+
+#include "common.hpp"
+#include "wsim.hpp"
+#include "MappedFile.hpp"
+
+// Bump whenever the layout of anything written here changes, including
+// the components themselves.
+const static uint32_t SNAPSHOT_VERSION = 7;
+
+// Layout, with every array starting on a cache line:
+//   header
+//   entity section: EntityManager::writeSnapshot()
+//   per component pool: section header, ComponentManager::writeSnapshot()
+//   chunk directory (index, kind, file offset, size), then per chunk
+//   either tiles, entity count, entity handles; or, for a chunk that was
+//   paged out, its page as paging.cpp lays it out, components included
+// Entity and pool sections carry their size, so the replay log can treat
+// them as flat byte ranges.
+struct SnapshotHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint64_t tick;
+    uint32_t numComponents;
+    uint32_t reserved;
+};
+
+struct SnapshotSection
+{
+    uint32_t id;    // ComponentId, or 0 for the entity table
+    uint32_t reserved;
+    uint64_t size;
+};
+
+struct SnapshotChunk
+{
+    uint32_t index;
+    uint32_t paged;     // nonzero if the chunk is stored as its page
+    uint64_t offset;
+    uint64_t size;
+};
+
+const static char SNAPSHOT_MAGIC[4] = { 'W', 'S', 'I', 'M' };
+
+// pools register themselves on first use, which may not have happened yet
+// when loading
+inline CMInterface* componentManager(ComponentId id)
+{
+    switch (id)
+    {
+    case ComponentId::Name: return CM(NameData);
+    case ComponentId::Position: return CM(PositionData);
+    case ComponentId::Movable: return CM(MovableData);
+    case ComponentId::Plant: return CM(PlantData);
+    case ComponentId::Inventory: return CM(InventoryData);
+    case ComponentId::Creature: return CM(CreatureData);
+    case ComponentId::Actor: return CM(ActorData);
+    case ComponentId::Pathfinding: return CM(PathfindingData);
+    case ComponentId::Growth: return CM(GrowthData);
+    default: return nullptr;
+    }
+}
+
+template<typename Fn>
+void writeSection(vector<char>& out, uint32_t id, Fn write)
+{
+    size_t at = out.size();
+    writeBytes(out, SnapshotSection{ id, 0, 0 });
+    padBytes(out, CACHE_LINE_SIZE);
+
+    size_t start = out.size();
+    write(out);
+    uint64_t size = out.size() - start;
+    memcpy(&out[at + offsetof(SnapshotSection, size)], &size, sizeof(size));
+}
+
+// returns the section's payload and skips in past it; throws if the
+// section runs past end
+inline const char* readSection(const char*& in, const char* end, SnapshotSection& section)
+{
+    if (static_cast<size_t>(end - in) < sizeof(section))
+        throw std::runtime_error("Snapshot section header past the end of the file");
+    readBytes(in, section);
+    alignPointer(in, CACHE_LINE_SIZE);
+    if (in > end || section.size > static_cast<uint64_t>(end - in))
+        throw std::runtime_error("Snapshot section " + to_string(section.id) + " runs past the end of the file");
+    const char* payload = in;
+    in += section.size;
+    return payload;
+}
+
+// Reads the chunk directory and checks every entry against the file.
+// Leaves in past it.
+inline const SnapshotChunk* readChunkDirectory(const MappedFile& file, const char*& in, uint32_t numWorldChunks,
+    uint64_t& numChunks, const string& path)
+{
+    const char* end = file.data() + file.size();
+    if (static_cast<size_t>(end - in) < sizeof(numChunks))
+        throw std::runtime_error("Corrupt snapshot " + path);
+    readBytes(in, numChunks);
+    alignPointer(in, CACHE_LINE_SIZE);
+    if (in > end || numChunks > static_cast<uint64_t>(end - in) / sizeof(SnapshotChunk))
+        throw std::runtime_error("Corrupt snapshot " + path);
+
+    const SnapshotChunk* dir = reinterpret_cast<const SnapshotChunk*>(in);
+    for (uint64_t i = 0; i < numChunks; ++i) {
+        if (dir[i].index >= numWorldChunks || dir[i].offset > file.size() || dir[i].size > file.size() - dir[i].offset)
+            throw std::runtime_error("Corrupt snapshot " + path);
+    }
+    in += numChunks * sizeof(SnapshotChunk);
+    return dir;
+}
+
+// checks the header and leaves in at the first section
+inline SnapshotHeader readSnapshotHeader(const MappedFile& file, const char*& in, const string& path)
+{
+    SnapshotHeader header;
+    if (file.size() < sizeof(header))
+        throw std::runtime_error("Not a snapshot: " + path);
+    readBytes(in, header);
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0)
+        throw std::runtime_error("Not a snapshot: " + path);
+    if (header.version != SNAPSHOT_VERSION)
+        throw std::runtime_error("Unsupported snapshot version " + to_string(header.version) + " in " + path);
+    alignPointer(in, CACHE_LINE_SIZE);
+    return header;
+}
@@ -6,107 +6,333 @@
 System::System(shared_ptr<World> world)
 {
     _world = world;
-    _thread.reset(new thread(&System::threadWrapper, this));
 }
 
 System::~System()
 {
-    if (!_terminated)
-        terminate();
 }
 
 void System::tick()
 {
-    lock_guard<mutex> lck(_mtx);
-    _tick = true;
-    _cv.notify_one();
+    process();
 }
 
-void System::terminate()
+void Scheduler::add(System* sys)
 {
-    _terminated = true;
-    _cv.notify_one();
-    _thread->join();
+    _systems.push_back(sys);
 }
 
-void System::waitForTick()
+void Scheduler::run()
 {
-    unique_lock<mutex> lck(_mtx);
-    _cv.wait(lck, [&]{ return !_tick; });
+    // a system waits for every earlier system it conflicts with
+    size_t n = _systems.size();
+    _dependents.assign(n, {});
+    _pending.assign(n, 0);
+    for (size_t j = 0; j < n; ++j)
+    {
+        for (size_t i = 0; i < j; ++i)
+        {
+            if (_systems[i]->getAccess().conflictsWith(_systems[j]->getAccess())) {
+                _dependents[i].push_back(j);
+                _pending[j]++;
+            }
+        }
+    }
+
+    // pick the roots before submitting any: a finished root counts its
+    // dependents down, and they'd look like roots too
+    vector<size_t> roots;
+    for (size_t i = 0; i < n; ++i) {
+        if (_pending[i] == 0)
+            roots.push_back(i);
+    }
+
+    JobGroup group;
+    for (size_t i : roots)
+        submit(i, &group);
+    JOBS->wait(&group);
 }
 
-void System::threadWrapper()
+void Scheduler::submit(size_t idx, JobGroup* group)
 {
-    while (!_terminated)
+    JOBS->submit(group, [this, idx, group] {
+        _systems[idx]->tick();
+        onFinished(idx, group);
+    });
+}
+
+// dependents are submitted before this job retires, so the group can't
+// drain early
+void Scheduler::onFinished(size_t idx, JobGroup* group)
+{
+    vector<size_t> ready;
     {
-        unique_lock<mutex> lck(_mtx);
-        _cv.wait(lck, [&]{ return _tick || _terminated; });
+        lock_guard<mutex> lck(_mtx);
+        for (size_t d : _dependents[idx]) {
+            if (--_pending[d] == 0)
+                ready.push_back(d);
+        }
+    }
 
-        if (_terminated)
-            return;
+    for (size_t d : ready)
+        submit(d, group);
+}
 
-        process();
-        _tick = false;
-        _cv.notify_one();
-    }
+// whether h is an actor heading for something; one that isn't keeps
+// drifting like any other mover
+static bool hasTarget(EntityHandle h)
+{
+    const ActorData* actor = CM(ActorData)->getComponentRO(h);
+    return actor && actor->action == Action::Move && EM->isValid(actor->target);
 }
 
 void MovableSystem::process()
 {
-    for (MovableData& md : *CM(MovableData))
+    // Bucket movers by chunk, so each chunk can be processed by one job.
+    // A move that stays inside its chunk only touches that chunk's data.
+    uint32_t numChunks = _world->getNumChunks();
+    _chunkStart.assign(numChunks + 1, 0);
+    view<const MovableData, const PositionData>().each([&](const MovableData&, const PositionData& pd) {
+        _chunkStart[_world->chunkIndex(pd.pos.x, pd.pos.y) + 1]++;
+    });
+    for (uint32_t c = 0; c < numChunks; ++c)
+        _chunkStart[c + 1] += _chunkStart[c];
+
+    _movers.resize(_chunkStart[numChunks]);
+    vector<uint32_t> fill(_chunkStart.begin(), _chunkStart.end() - 1);
+    view<const MovableData, const PositionData>().each([&](const MovableData&, const PositionData& pd) {
+        _movers[fill[_world->chunkIndex(pd.pos.x, pd.pos.y)]++] = &pd;
+    });
+
+    JOBS->parallelFor(0, numChunks, 16, [&](size_t begin, size_t end)
     {
-        Entity *e = EM->getEntity(md.parent);
-        Position& pos = e->getComponent<PositionData>()->pos;
+        for (size_t c = begin; c < end; ++c)
+        {
+            for (uint32_t i = _chunkStart[c]; i < _chunkStart[c + 1]; ++i)
+            {
+                // only looked up for writing once there's something to
+                // write, so the replay log isn't told about the rest
+                const PositionData& pd = *_movers[i];
+                const Position& pos = pd.pos;
 
-        if (pos.x < _world->getWidth() - 1 && pos.y < _world->getHeight() - 1)
-            _world->tryMove(e, pos.x + 1, pos.y + 1);
-    }
+                int x, y;
+                const PathfindingData* path = CM(PathfindingData)->getComponentRO(pd.parent);
+                bool drift = !path;
+                if (path && path->flowGoal)
+                {
+                    int dx, dy;
+                    if (!_flowFields.direction(path->flowGoal - 1, pos, dx, dy)) {
+                        // there, or the field can't get us there; either
+                        // way it's up to PathfindingSystem now
+                        PathfindingData* own = CM(PathfindingData)->getComponent(pd.parent);
+                        if (!_flowFields.inGoal(own->flowGoal - 1, pos))
+                            own->schedule = _world->getTick() + PATH_RETRY_TICKS;
+                        own->flowGoal = 0;
+                        continue;
+                    }
+                    x = pos.x + dx;
+                    y = pos.y + dy;
+                }
+                else if (path)
+                {
+                    // a step is dropped once we're standing on it, so a
+                    // move that gets deferred or refused is tried again
+                    int dx, dy;
+                    auto standingOnNext = [&](const PathfindingData& p) {
+                        return PATHS->peek(p.path, dx, dy) && p.at.x + dx == pos.x && p.at.y + dy == pos.y;
+                    };
+                    if (standingOnNext(*path)) {
+                        PathfindingData* own = CM(PathfindingData)->getComponent(pd.parent);
+                        while (standingOnNext(*own)) {
+                            own->at = pos;
+                            PATHS->advance(own->path);
+                        }
+                    }
+                    if (PATHS->peek(path->path, dx, dy)) {
+                        x = path->at.x + dx;
+                        y = path->at.y + dy;
+                    }
+                    else if (hasTarget(pd.parent)) {
+                        // arrived, or waiting on PathfindingSystem
+                        continue;
+                    }
+                    else
+                        drift = true;
+                }
+                if (drift)
+                {
+                    if (pos.x >= static_cast<int32_t>(_world->getWidth() - 1) || pos.y >= static_cast<int32_t>(_world->getHeight() - 1))
+                        continue;
+                    x = pos.x + 1;
+                    y = pos.y + 1;
+                }
+
+                // start paging in the chunk we're heading into before we
+                // get there
+                int ax = x + (x - pos.x) * PREFETCH_DISTANCE;
+                int ay = y + (y - pos.y) * PREFETCH_DISTANCE;
+                if (_world->chunkIndex(ax, ay) != c)
+                    _world->prefetch(ax, ay);
+
+                // a move into another chunk touches two chunks, so it
+                // waits for the end of the tick
+                if (_world->chunkIndex(x, y) == c)
+                    _world->tryMove(*CM(PositionData)->getComponent(pd.parent), x, y);
+                else
+                    _world->commands().move(pd.parent, x, y);
+            }
+        }
+    });
 }
 
 void ActorSystem::process()
 {
-    vector<ActorData>& advec = CM(ActorData)->getData();
-#pragma omp parallel for
-    for (int32_t h = 0; h < advec.size(); h++)
+    view<const ActorData, const PositionData>().eachSpan([&](Span<const ActorData> actors, Span<const PositionData> positions)
     {
-        ActorData& actor = advec[h];
-        if (actor.action == Action::Harvest)
+        JOBS->parallelFor(0, actors.size(), 1024, [&](size_t begin, size_t end)
         {
-            // TODO: something
+            for (size_t h = begin; h < end; h++)
+            {
+                const ActorData& actor = actors[h];
+                if (actor.action == Action::Harvest)
+                {
+                    // TODO: something
+                }
+                else if (actor.action != Action::Move || !EM->isValid(actor.target))
+                {
+                    ActorData* own = CM(ActorData)->getComponent(actor.parent);
+                    own->target = _world->findNearestPlant(positions[h].pos);
+
+                    own->action = Action::Move;
+                }
+            }
+        });
+    });
+}
+
+void PathfindingSystem::process()
+{
+    uint64_t now = _world->getTick();
+    _requests.clear();
+    view<const ActorData, const PositionData, const PathfindingData>().each(
+        [&](const ActorData& actor, const PositionData& pd, const PathfindingData& path)
+    {
+        // only looked up for writing when something changes, so the replay
+        // log isn't told about actors that carry on as they were
+        auto own = [&]() { return CM(PathfindingData)->getComponent(path.parent); };
+        auto dropFlow = [&]() {
+            if (path.flowGoal)
+                own()->flowGoal = 0;
+        };
+        auto dropPath = [&]() {
+            if (!path.path.released())
+                PATHS->release(own()->path);
+        };
+
+        if (actor.action != Action::Move || !EM->isValid(actor.target) || path.schedule > now) {
+            dropFlow();
+            return;
+        }
+        const PositionData* target = CM(PositionData)->getComponentRO(actor.target);
+        if (!target) {
+            dropFlow();
+            return;
         }
-        else if (actor.action != Action::Move)
+
+        // far off: follow the field as far as the target's goal square
+        const Position& to = target->pos;
+        uint32_t goal;
+        if (std::max(std::abs(to.x - pd.pos.x), std::abs(to.y - pd.pos.y)) > FLOW_FIELD_MIN_DISTANCE &&
+            !_flowFields.inGoal(goal = _flowFields.goalAt(to), pd.pos) && _flowFields.covers(goal, pd.pos))
         {
-            Entity* e = EM->getEntity(actor.parent);
-            _world->findNearestPlant(e->getComponent<PositionData>()->pos);
+            dropPath();
+            if (path.flowGoal != goal + 1)
+                own()->flowGoal = goal + 1;
+            _flowFields.retain(goal);
+            return;
+        }
+        dropFlow();
 
-            actor.action = Action::Move;
+        // already next to it, or on its way there
+        auto nextTo = [&](const Position& p) { return std::abs(to.x - p.x) <= 1 && std::abs(to.y - p.y) <= 1; };
+        if (nextTo(pd.pos)) {
+            dropPath();
+            return;
         }
-    }
-}
+        if (!path.path.empty() && nextTo(path.end))
+            return;
 
-void PlantSystem::process()
-{
-    for (PlantData& plant : *CM(PlantData))
+        if (_requests.size() < MAX_PATH_REQUESTS)
+            _requests.push_back(Request{ own(), pd.pos, to });
+    });
+
+    JOBS->parallelFor(0, _requests.size(), 64, [&](size_t begin, size_t end)
     {
-        plant.growth_status++;
-        if (plant.growth_status >= plant.growth_time)
+        vector<Position> steps;
+        vector<uint8_t> packed;
+        for (size_t i = begin; i < end; ++i)
         {
-            plant.growth_status = 0;
-            if (plant.fruit < plant.max_fruit)
-                plant.fruit++;
+            Request& r = _requests[i];
+            PATHS->release(r.path->path);
+            if (_pathfinder.findPath(r.from, r.to, steps)) {
+                // the target is standing on the last tile
+                packed.clear();
+                Position at = r.from;
+                for (size_t s = 0; s + 1 < steps.size(); ++s) {
+                    packed.push_back(packStep(steps[s].x - at.x, steps[s].y - at.y));
+                    at = steps[s];
+                }
+                r.path->path = PATHS->store(packed.data(), packed.size());
+                r.path->at = r.from;
+                r.path->end = at;
+                r.path->schedule = 0;
+            }
+            else {
+                r.path->schedule = now + PATH_RETRY_TICKS;
+            }
         }
-    }
+    });
 }
 
-void CreatureSystem::process()
+// how plant grows: its own GrowthData if it has one, or else its
+// prefab's
+static const GrowthData& growthOf(const PlantData& plant)
 {
-    for (CreatureData& creature : *CM(CreatureData))
-    {
-        creature.hunger++;
+    static const GrowthData defaults = GrowthData();
+    const GrowthData* growth = EM->getEntity(plant.parent)->getComponentRO<GrowthData>();
+    return growth ? *growth : defaults;
+}
 
-        if (creature.hunger > creature.eating_time) {
-            Entity *e = EM->getEntity(creature.parent);
-            e->valid = false;
-        }
-    }
+// A plant gains a fruit every growth_time ticks until it's full, the
+// first one growth_time ticks after it's planted.
+uint64_t PlantSystem::firstWakeup(const PlantData& plant, uint64_t now)
+{
+    const GrowthData& growth = growthOf(plant);
+    if (plant.fruit >= growth.max_fruit)
+        return NOT_SCHEDULED;
+    return now + growth.growth_time - 1;
+}
+
+uint64_t PlantSystem::wake(PlantData& plant, uint64_t now)
+{
+    const GrowthData& growth = growthOf(plant);
+    if (plant.fruit < growth.max_fruit)
+        plant.fruit++;
+    return plant.fruit < growth.max_fruit ? now + growth.growth_time : NOT_SCHEDULED;
+}
+
+// Hunger goes up by one a tick; the creature starves on the tick it
+// passes eating_time.
+uint64_t CreatureSystem::firstWakeup(const CreatureData& creature, uint64_t now)
+{
+    if (creature.hunger >= creature.eating_time)
+        return now;
+    return now + creature.eating_time - creature.hunger;
+}
+
+uint64_t CreatureSystem::wake(CreatureData& creature, uint64_t /*now*/)
+{
+    if (EM->isValid(creature.parent))
+        _world->commands().destroy(creature.parent);
+    return NOT_SCHEDULED;
 }
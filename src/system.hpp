@@ -1,5 +1,42 @@
 #include "common.hpp"
 #include "wsim.hpp"
+#include "timing.hpp"
+#include "pathfinding.hpp"
+#include "flowfield.hpp"
+
+// World data that systems touch besides components
+enum class Resource : uint8_t
+{
+    Entities,       // the EntityManager's entity table
+    ChunkEntities,  // WorldChunk::entities
+    Blocked,        // WorldChunk::blocked
+    Terrain,
+};
+
+typedef uint32_t ResourceMask;
+
+inline ResourceMask resourceBit(Resource r)
+{
+    return 1u << static_cast<uint8_t>(r);
+}
+
+// What a system reads and writes during process()
+struct SystemAccess
+{
+    ComponentMask readComponents = 0;
+    ComponentMask writeComponents = 0;
+    ResourceMask readResources = 0;
+    ResourceMask writeResources = 0;
+
+    // true if the two systems cannot safely run at the same time
+    bool conflictsWith(const SystemAccess& other) const
+    {
+        return (writeComponents & (other.readComponents | other.writeComponents)) ||
+            (other.writeComponents & readComponents) ||
+            (writeResources & (other.readResources | other.writeResources)) ||
+            (other.writeResources & readResources);
+    }
+};
 
 class System
 {
@@ -7,54 +44,229 @@ public:
     System(shared_ptr<World> world);
     virtual ~System();
 
+    // run one tick's worth of work; called by the Scheduler on the job pool
     void tick();
-    void terminate();
-    void waitForTick();
+
+    const SystemAccess& getAccess() const { return _access; }
 
 protected:
-    void threadWrapper();
+    template<typename... Ts>
+    void reads()
+    {
+        (void)initializer_list<int>{ (_access.readComponents |= componentBit(Ts::id), 0)... };
+    }
+
+    template<typename... Ts>
+    void writes()
+    {
+        (void)initializer_list<int>{ (_access.writeComponents |= componentBit(Ts::id), 0)... };
+    }
+
+    void reads(Resource r) { _access.readResources |= resourceBit(r); }
+    void writes(Resource r) { _access.writeResources |= resourceBit(r); }
+
+    // Random numbers for entity h this tick. The same entity on the same
+    // tick always gets the same sequence, whichever thread asks.
+    CounterRandom random(const EntityHandle& h) const
+    {
+        return CounterRandom(h.raw, _world->getTick());
+    }
+
     virtual void process() = 0;
-    unique_ptr<std::thread> _thread;
-    std::condition_variable _cv;
-    std::mutex _mtx;
-    bool _tick = false;
-    bool _terminated = false;
     shared_ptr<World> _world;
+    SystemAccess _access;
+};
+
+// Runs each system once per tick as a job. Systems whose declared accesses
+// conflict run in the order they were added; everything else runs in
+// parallel.
+class Scheduler
+{
+public:
+    void add(System* sys);
+    void run();
+
+private:
+    void submit(size_t idx, JobGroup* group);
+    void onFinished(size_t idx, JobGroup* group);
+
+    vector<System*> _systems;
+    vector<vector<size_t>> _dependents;
+    vector<size_t> _pending;
+    std::mutex _mtx;
 };
 
+// Movers with a PathfindingData take the next step of their path, if
+// they have one and the tile is free; the rest drift diagonally.
 class MovableSystem : public System
 {
 public:
-    MovableSystem(shared_ptr<World> world) : System(world) {}
+    MovableSystem(shared_ptr<World> world, FlowFields& flowFields) : System(world), _flowFields(flowFields)
+    {
+        reads<MovableData>();
+        writes<PositionData, PathfindingData>();
+        writes(Resource::ChunkEntities);
+        writes(Resource::Blocked);
+        reads(Resource::Terrain);
+    }
 
 protected:
     void process();
+
+private:
+    FlowFields& _flowFields;
+    vector<uint32_t> _chunkStart;  // movers bucketed by chunk index
+    vector<const PositionData*> _movers;
 };
 
 // handles most of the AI
 class ActorSystem : public System
 {
 public:
-    ActorSystem(shared_ptr<World> world) : System(world) {}
+    ActorSystem(shared_ptr<World> world) : System(world)
+    {
+        reads<PositionData>();
+        writes<ActorData>();
+        reads(Resource::Entities);
+        reads(Resource::ChunkEntities);
+    }
 
 protected:
     void process();
 };
 
-class CreatureSystem : public System
+// at most this many paths are searched for per tick; the rest wait
+const static size_t MAX_PATH_REQUESTS = 8192;
+
+// ticks to wait before trying again for a target that couldn't be reached
+const static uint64_t PATH_RETRY_TICKS = 60;
+
+// targets farther than this follow a flow field instead of a path
+const static int FLOW_FIELD_MIN_DISTANCE = DIRECT_SEARCH_RANGE;
+
+// Finds a path for each actor that is moving toward a target and has no
+// path there yet; it ends next to the target, since the target's own tile
+// is taken. Requests are gathered over the whole tick and then solved
+// together on the job pool.
+//
+// Actors whose target is far off follow the flow field toward the
+// target's goal square instead, so a crowd converging on one place shares
+// a single search, and only search for a path once they're in the square.
+class PathfindingSystem : public System
 {
 public:
-    CreatureSystem(shared_ptr<World> world) : System(world) {}
+    PathfindingSystem(shared_ptr<World> world, Pathfinder& pathfinder, FlowFields& flowFields)
+        : System(world), _pathfinder(pathfinder), _flowFields(flowFields)
+    {
+        reads<ActorData, PositionData>();
+        writes<PathfindingData>();
+        reads(Resource::Entities);
+        reads(Resource::Terrain);
+    }
 
 protected:
     void process();
+
+private:
+    struct Request
+    {
+        PathfindingData* path;
+        Position from;
+        Position to;
+    };
+
+    Pathfinder& _pathfinder;
+    FlowFields& _flowFields;
+    vector<Request> _requests;
 };
 
-class PlantSystem : public System
+// A system that only looks at a T when the tick in its schedule field
+// comes up, so a tick costs as much as the wakeups due in it. Components
+// added since the last tick, including ones paged or loaded back in, are
+// put on the wheel first.
+template<typename T>
+class ScheduledSystem : public System
 {
 public:
-    PlantSystem(shared_ptr<World> world) : System(world) {}
+    ScheduledSystem(shared_ptr<World> world, TimingWheel& timers) : System(world), _timers(timers)
+    {
+        writes<T>();
+        CM(T)->trackAdded();
+    }
 
 protected:
-    void process();
+    void process()
+    {
+        uint64_t now = _world->getTick();
+        for (const EntityHandle& h : CM(T)->takeAdded())
+        {
+            T* c = CM(T)->getComponent(h);
+            if (!c || !(c->parent == h))
+                continue;
+            if (c->schedule == 0)
+                c->schedule = firstWakeup(*c, now);
+            if (c->schedule != NOT_SCHEDULED)
+                _timers.schedule(h, c->schedule);
+        }
+
+        // in handle order, whatever order the wheel kept them in; a
+        // component paged out and back in can be on the wheel twice
+        _due.clear();
+        _timers.advance(now, _due);
+        std::sort(_due.begin(), _due.end(), [](const Wakeup& a, const Wakeup& b) {
+            return a.first.raw < b.first.raw || (a.first.raw == b.first.raw && a.second < b.second);
+        });
+        _due.erase(std::unique(_due.begin(), _due.end()), _due.end());
+
+        for (const Wakeup& w : _due)
+        {
+            // skip it if it was destroyed, paged out or rescheduled since
+            T* c = CM(T)->getComponent(w.first);
+            if (!c || !(c->parent == w.first) || c->schedule != w.second)
+                continue;
+
+            c->schedule = wake(*c, now);
+            if (c->schedule != NOT_SCHEDULED)
+                _timers.schedule(w.first, c->schedule);
+        }
+    }
+
+    // the first tick c needs to wake at, or NOT_SCHEDULED
+    virtual uint64_t firstWakeup(const T& c, uint64_t now) = 0;
+
+    // handles c's wakeup and returns the next one, or NOT_SCHEDULED
+    virtual uint64_t wake(T& c, uint64_t now) = 0;
+
+private:
+    typedef pair<EntityHandle, uint64_t> Wakeup;
+
+    TimingWheel& _timers;
+    vector<Wakeup> _due;
+};
+
+class CreatureSystem : public ScheduledSystem<CreatureData>
+{
+public:
+    CreatureSystem(shared_ptr<World> world, TimingWheel& timers) : ScheduledSystem(world, timers)
+    {
+        writes(Resource::Entities);
+    }
+
+protected:
+    uint64_t firstWakeup(const CreatureData& creature, uint64_t now);
+    uint64_t wake(CreatureData& creature, uint64_t now);
+};
+
+class PlantSystem : public ScheduledSystem<PlantData>
+{
+public:
+    PlantSystem(shared_ptr<World> world, TimingWheel& timers) : ScheduledSystem(world, timers)
+    {
+        reads<GrowthData>();
+        reads(Resource::Entities);
+    }
+
+protected:
+    uint64_t firstWakeup(const PlantData& plant, uint64_t now);
+    uint64_t wake(PlantData& plant, uint64_t now);
 };
@@ -0,0 +1,80 @@
+#include "timing.hpp"
+
+TimingWheel::TimingWheel(uint64_t now)
+{
+    _now = now;
+}
+
+void TimingWheel::schedule(const EntityHandle& h, uint64_t tick)
+{
+    _size++;
+    if (tick <= _now)
+        _late.push_back(Timer{ h, tick });
+    else
+        place(Timer{ h, tick }, _now);
+}
+
+// t.tick >= now; a timer due at now itself goes in now's level 0 slot
+void TimingWheel::place(const Timer& t, uint64_t now)
+{
+    for (int l = 0; l < LEVELS; ++l)
+    {
+        int above = SLOT_BITS * (l + 1);
+        if ((t.tick >> above) == (now >> above)) {
+            _slots[l][(t.tick >> (SLOT_BITS * l)) & (SLOTS - 1)].push_back(t);
+            return;
+        }
+    }
+    _overflow.push_back(t);
+}
+
+void TimingWheel::cascade(vector<Timer>& slot, uint64_t now)
+{
+    _moving.clear();
+    _moving.swap(slot);
+    for (const Timer& t : _moving)
+        place(t, now);
+}
+
+void TimingWheel::advance(uint64_t now, vector<pair<EntityHandle, uint64_t>>& due)
+{
+    for (const Timer& t : _late)
+        due.emplace_back(t.handle, t.tick);
+    _size -= _late.size();
+    _late.clear();
+
+    while (_now < now && _size > 0)
+    {
+        uint64_t t = ++_now;
+
+        // refill the lower levels from the top down, so a timer can drop
+        // several levels in one tick
+        if ((t & ((uint64_t(1) << (SLOT_BITS * LEVELS)) - 1)) == 0)
+            cascade(_overflow, t);
+        for (int l = LEVELS - 1; l > 0; --l)
+        {
+            if ((t & ((uint64_t(1) << (SLOT_BITS * l)) - 1)) == 0)
+                cascade(_slots[l][(t >> (SLOT_BITS * l)) & (SLOTS - 1)], t);
+        }
+
+        vector<Timer>& slot = _slots[0][t & (SLOTS - 1)];
+        for (const Timer& timer : slot)
+            due.emplace_back(timer.handle, timer.tick);
+        _size -= slot.size();
+        slot.clear();
+    }
+
+    // nothing left to move down, so the skipped ticks don't matter
+    _now = std::max(_now, now);
+}
+
+void TimingWheel::clear()
+{
+    for (auto& level : _slots) {
+        for (auto& slot : level)
+            slot.clear();
+    }
+    _overflow.clear();
+    _late.clear();
+    _size = 0;
+}
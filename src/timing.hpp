@@ -0,0 +1,48 @@
+#pragma once
+
+#include "common.hpp"
+
+// Hierarchical timing wheel of entity wakeups, keyed by tick. Level l has
+// 256 slots of 256^l ticks each; a wakeup goes in the lowest level whose
+// span still covers it, and moves down a level each time its slot comes
+// up, so scheduling is O(1) and advancing costs one slot per level per
+// tick plus the wakeups that are due. Anything past the top level waits
+// in an overflow list.
+class TimingWheel
+{
+public:
+    TimingWheel(uint64_t now = 0);
+
+    // wake h at tick; a tick that has already passed wakes it at the next
+    // advance()
+    void schedule(const EntityHandle& h, uint64_t tick);
+
+    // Moves to tick now and appends everything due since the last call to
+    // due, as (handle, tick) pairs in no particular order.
+    void advance(uint64_t now, vector<pair<EntityHandle, uint64_t>>& due);
+
+    uint64_t now() const { return _now; }
+    size_t size() const { return _size; }
+    void clear();
+
+private:
+    struct Timer
+    {
+        EntityHandle handle;
+        uint64_t tick;
+    };
+
+    const static int SLOT_BITS = 8;
+    const static size_t SLOTS = 1 << SLOT_BITS;
+    const static int LEVELS = 4;
+
+    void place(const Timer& t, uint64_t now);
+    void cascade(vector<Timer>& slot, uint64_t now);
+
+    vector<Timer> _slots[LEVELS][SLOTS];
+    vector<Timer> _overflow;
+    vector<Timer> _late;        // scheduled for a tick that had passed
+    vector<Timer> _moving;
+    uint64_t _now;
+    size_t _size = 0;
+};
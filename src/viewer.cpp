@@ -87,7 +87,7 @@ int main()
         for (EntityHandle eh : chunk.entities)
         {
             Entity* e = EM->getEntity(eh);
-            Position& pos = e->getComponent<PositionData>()->pos;
+            const Position& pos = e->getComponentRO<PositionData>()->pos;
 
             r.x = pos.x - offset;
             r.y = pos.y - offset;
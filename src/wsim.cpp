@@ -1,53 +1,277 @@
 #include "common.hpp"
 #include "wsim.hpp"
 #include "system.hpp"
+#include "pathfinding.hpp"
+#include "flowfield.hpp"
 
-World::World(uint32_t width, uint32_t height)
+ChunkTerrain::ChunkTerrain()
 {
-    if (width % CHUNK_SIZE != 0 || height % CHUNK_SIZE != 0) {
-        throw std::runtime_error("World width and height must be multiples of " + to_string(CHUNK_SIZE));
+    _rle.init(CHUNK_SIZE, CHUNK_SIZE);
+}
+
+Terrain ChunkTerrain::operator()(uint32_t x, uint32_t y) const
+{
+    if (_dense)
+        return (*_dense)(x, y);
+    return _rle(x, y);
+}
+
+void ChunkTerrain::set(uint32_t x, uint32_t y, Terrain t)
+{
+    if (_dense) {
+        (*_dense)(x, y) = t;
+        return;
     }
-    _width = width;
-    _height = height;
 
-    _chunks.init(_width / CHUNK_SIZE, _height / CHUNK_SIZE);
+    _rle.set(x, y, t);
+    if (_rle.numRuns() > MAX_RUNS)
+        optimize();
+}
+
+void ChunkTerrain::fill(Terrain t)
+{
+    _dense.reset();
+    _rle.init(CHUNK_SIZE, CHUNK_SIZE, t);
+}
+
+void ChunkTerrain::optimize()
+{
+    if (_dense)
+    {
+        size_t runs = 0;
+        for (uint32_t y = 0; y < CHUNK_SIZE; ++y)
+            forEachRun(y, [&](uint32_t, uint32_t, Terrain) { runs++; });
+
+        // only go back to RLE with some headroom, so we don't flip-flop
+        if (runs > MAX_RUNS / 2)
+            return;
 
-    for (int cy = 0; cy < static_cast<int>(_chunks.getHeight()); ++cy)
+        RLEMatrix<Terrain> rle(CHUNK_SIZE, CHUNK_SIZE, (*_dense)(0, 0));
+        for (uint32_t y = 0; y < CHUNK_SIZE; ++y)
+        {
+            for (uint32_t x = 0; x < CHUNK_SIZE; ++x)
+                rle.set(x, y, (*_dense)(x, y));
+        }
+        _rle = std::move(rle);
+        _dense.reset();
+    }
+    else if (_rle.numRuns() > MAX_RUNS)
     {
-        for (int cx = 0; cx < static_cast<int>(_chunks.getWidth()); ++cx)
+        _dense.reset(new Matrix<Terrain>(CHUNK_SIZE, CHUNK_SIZE));
+        for (uint32_t y = 0; y < CHUNK_SIZE; ++y)
         {
-            auto& m = _chunks(cx, cy).terrain;
-            m.fill(Terrain{ TerrainType::Grass });
+            _rle.forEachRun(y, [&](uint32_t x0, uint32_t x1, Terrain t) {
+                for (uint32_t x = x0; x < x1; ++x)
+                    (*_dense)(x, y) = t;
+            });
         }
+        _rle.init(CHUNK_SIZE, CHUNK_SIZE);
+    }
+}
+
+size_t ChunkTerrain::memoryUsage() const
+{
+    if (_dense)
+        return sizeof(*this) + CHUNK_SIZE * CHUNK_SIZE * sizeof(Terrain);
+    return sizeof(*this) + _rle.memoryUsage();
+}
+
+void ChunkTerrain::serialize(vector<char>& out) const
+{
+    writeBytes(out, static_cast<uint8_t>(isCompressed()));
+    if (isCompressed())
+    {
+        writeBytes(out, static_cast<uint32_t>(_rle.numRuns()));
+        writeBytes(out, _rle.getValues().data(), _rle.numRuns());
+        writeBytes(out, _rle.getEnds().data(), _rle.numRuns());
+        return;
     }
 
-    uint32_t wall_x = _width / 2 + 100;
-    uint32_t wall_y = _height / 2 + 100;
+    for (uint32_t y = 0; y < CHUNK_SIZE; ++y)
+    {
+        for (uint32_t x = 0; x < CHUNK_SIZE; ++x)
+            writeBytes(out, (*_dense)(x, y));
+    }
+}
 
-    for (uint32_t y = 0; y < _height; ++y)
+void ChunkTerrain::deserialize(const char*& in)
+{
+    uint8_t compressed;
+    readBytes(in, compressed);
+    if (compressed)
     {
-        for (uint32_t x = 0; x < _width; ++x)
-        {
-            if (x == wall_x || y == wall_y)
-                at(x, y).type = TerrainType::Wall;
+        uint32_t runs;
+        readBytes(in, runs);
+        vector<Terrain> values(runs);
+        vector<uint32_t> ends(runs);
+        readBytes(in, values.data(), runs);
+        readBytes(in, ends.data(), runs);
+        _rle.assign(CHUNK_SIZE, CHUNK_SIZE, std::move(values), std::move(ends));
+        _dense.reset();
+        return;
+    }
+
+    _dense.reset(new Matrix<Terrain>(CHUNK_SIZE, CHUNK_SIZE));
+    for (uint32_t y = 0; y < CHUNK_SIZE; ++y)
+    {
+        for (uint32_t x = 0; x < CHUNK_SIZE; ++x)
+            readBytes(in, (*_dense)(x, y));
+    }
+    _rle.init(CHUNK_SIZE, CHUNK_SIZE);
+}
+
+void WorldChunk::writeTiles(vector<char>& out) const
+{
+    terrain.serialize(out);
+
+    size_t countAt = out.size();
+    uint32_t tiles = 0;
+    writeBytes(out, tiles);
+    blocked.forEachSetTile([&](uint32_t tx, uint32_t ty, uint64_t bits) {
+        writeBytes(out, static_cast<uint16_t>(tx));
+        writeBytes(out, static_cast<uint16_t>(ty));
+        writeBytes(out, bits);
+        tiles++;
+    });
+    memcpy(&out[countAt], &tiles, sizeof(tiles));
+}
+
+void WorldChunk::readTiles(const char*& in)
+{
+    terrain.deserialize(in);
+
+    uint32_t tiles;
+    readBytes(in, tiles);
+    for (uint32_t i = 0; i < tiles; ++i)
+    {
+        uint16_t tx, ty;
+        uint64_t bits;
+        readBytes(in, tx);
+        readBytes(in, ty);
+        readBytes(in, bits);
+        blocked.setTile(tx, ty, bits);
+    }
+}
+
+// grass everywhere, crossed by one wall running the full height of the
+// world and one running its full width
+static ChunkGenerator defaultGenerator(uint32_t width, uint32_t height)
+{
+    uint32_t wall_x = width / 2 + 100;
+    uint32_t wall_y = height / 2 + 100;
+
+    return [=](WorldChunk& chunk, uint32_t cx, uint32_t cy) {
+        uint32_t x0 = cx * CHUNK_SIZE;
+        uint32_t y0 = cy * CHUNK_SIZE;
+
+        chunk.terrain.fill(Terrain{ TerrainType::Grass });
+
+        if (wall_x >= x0 && wall_x < x0 + CHUNK_SIZE) {
+            for (uint32_t y = 0; y < CHUNK_SIZE; ++y)
+                chunk.terrain.set(wall_x - x0, y, Terrain{ TerrainType::Wall });
+        }
+        if (wall_y >= y0 && wall_y < y0 + CHUNK_SIZE) {
+            for (uint32_t x = 0; x < CHUNK_SIZE; ++x)
+                chunk.terrain.set(x, wall_y - y0, Terrain{ TerrainType::Wall });
         }
+    };
+}
+
+World::World(uint32_t width, uint32_t height, ChunkGenerator generator)
+{
+    if (width % CHUNK_SIZE != 0 || height % CHUNK_SIZE != 0) {
+        throw std::runtime_error("World width and height must be multiples of " + to_string(CHUNK_SIZE));
     }
+    _width = width;
+    _height = height;
+    _chunksX = _width / CHUNK_SIZE;
+    _chunksY = _height / CHUNK_SIZE;
+    _generator = generator ? generator : defaultGenerator(_width, _height);
+
+    _chunks.reset(new atomic<WorldChunk*>[getNumChunks()]);
+    for (uint32_t i = 0; i < getNumChunks(); ++i)
+        _chunks[i] = nullptr;
+    _wallVersions.assign(getNumChunks(), 0);
+    growCommandBuffers();
 
     EM->clear();
-    // clear all ComponentManagers
-    for (auto& p : CMTable::getSingleton()->getTable()) {
-        p.second->clear();
+}
+
+World::~World()
+{
+    JOBS->wait(&_prefetchJobs);
+    if (_pageFile.is_open()) {
+        _pageFile.close();
+        std::remove(_pagePath.c_str());
     }
+
+    for (uint32_t i = 0; i < getNumChunks(); ++i)
+        delete _chunks[i].load();
 }
 
 WorldChunk& World::chunkAt(int x, int y)
 {
     if (x >= static_cast<int>(_width) || y >= static_cast<int>(_height) || x < 0 || y < 0)
         throw std::runtime_error("World coordinate out of bounds");
-    return _chunks(x / CHUNK_SIZE, y / CHUNK_SIZE);
+
+    uint32_t idx = chunkIndex(x, y);
+    WorldChunk* chunk = _chunks[idx].load(memory_order_acquire);
+    if (chunk) {
+        touch(*chunk);
+        return *chunk;
+    }
+    return loadChunk(idx);
 }
 
-Terrain& World::at(int x, int y)
+// Paged-out chunks count as missing here; they're only brought back by
+// chunkAt().
+WorldChunk* World::findChunk(int x, int y)
+{
+    if (x >= static_cast<int>(_width) || y >= static_cast<int>(_height) || x < 0 || y < 0)
+        throw std::runtime_error("World coordinate out of bounds");
+    WorldChunk* chunk = _chunks[chunkIndex(x, y)].load(memory_order_acquire);
+    if (chunk)
+        touch(*chunk);
+    return chunk;
+}
+
+// Two threads may race to create the same chunk; the loser throws its
+// copy away.
+WorldChunk& World::materializeChunk(uint32_t idx)
+{
+    WorldChunk* chunk = new WorldChunk;
+    _generator(*chunk, idx % _chunksX, idx / _chunksX);
+
+    WorldChunk* expected = nullptr;
+    if (!_chunks[idx].compare_exchange_strong(expected, chunk, memory_order_acq_rel)) {
+        delete chunk;
+        return *expected;
+    }
+    return *chunk;
+}
+
+size_t World::getNumMaterialized() const
+{
+    size_t n = 0;
+    for (uint32_t i = 0; i < getNumChunks(); ++i) {
+        if (_chunks[i].load(memory_order_relaxed))
+            n++;
+    }
+    return n;
+}
+
+// row-major index of the chunk containing (x, y); no bounds checking
+uint32_t World::chunkIndex(int x, int y) const
+{
+    return (y / CHUNK_SIZE) * _chunksX + (x / CHUNK_SIZE);
+}
+
+uint32_t World::getNumChunks() const
+{
+    return _chunksX * _chunksY;
+}
+
+Terrain World::at(int x, int y)
 {
     int relx = x % CHUNK_SIZE;
     int rely = y % CHUNK_SIZE;
@@ -57,6 +281,16 @@ Terrain& World::at(int x, int y)
     return chunk.terrain(relx, rely);
 }
 
+void World::setTerrain(int x, int y, Terrain t)
+{
+    WorldChunk& chunk = chunkAt(x, y);
+    bool wasWall = chunk.terrain(x % CHUNK_SIZE, y % CHUNK_SIZE).type == TerrainType::Wall;
+    chunk.terrain.set(x % CHUNK_SIZE, y % CHUNK_SIZE, t);
+    chunk.terrainDirty = true;
+    if (wasWall != (t.type == TerrainType::Wall))
+        _wallVersions[chunkIndex(x, y)]++;
+}
+
 uint32_t World::getWidth() const
 {
     return _width;
@@ -69,36 +303,149 @@ uint32_t World::getHeight() const
 
 void World::addEntity(Entity* e)
 {
-    Position& pos = e->getComponent<PositionData>()->pos;
+    const Position& pos = e->getComponentRO<PositionData>()->pos;
     WorldChunk& chunk = chunkAt(pos.x, pos.y);
 
     chunk.entities.push_back(e->handle);
+    chunk.spatial.insert(e->handle, pos.x, pos.y);
+    chunk.occupancy.insert(WorldChunk::cellIndex(pos.x, pos.y), e->handle);
     setBlocked(pos.x, pos.y, true);
 }
 
-void World::move(Entity* e, int x, int y)
+void World::spawnBatch(const Prefab& pf, size_t count, uint64_t seed, const Placement& place)
+{
+    if (!(pf.copied & componentBit(PositionData::id)))
+        throw std::runtime_error("Prefab " + pf.name + " must copy PositionData to be spawned in bulk");
+
+    // how many land in each chunk, then where each chunk's run of the
+    // batch starts; the batch is in chunk order, so each chunk's entities
+    // are neighbours in the entity table and the pools too
+    uint32_t numChunks = getNumChunks();
+    vector<uint32_t> first(numChunks + 1, 0);
+    mt19937_64 rng(seed);
+    uniform_int_distribution<uint32_t> chunkDist(0, numChunks - 1);
+    for (size_t i = 0; i < count; ++i)
+        first[chunkDist(rng) + 1]++;
+    for (uint32_t i = 0; i < numChunks; ++i)
+        first[i + 1] += first[i];
+
+    Span<Entity> batch = EM->spawnBatch(pf, count);
+
+    // each chunk only touches its own tiles and its own entities'
+    // positions, so they don't need locking; unplaced[idx] is where the
+    // chunk's entities that didn't fit start, if it ran out of room
+    vector<uint32_t> unplaced(first.begin() + 1, first.end());
+    JOBS->parallelFor(0, numChunks, 4, [&](size_t begin, size_t end) {
+        uniform_int_distribution<int> tileDist(0, CHUNK_SIZE - 1);
+        vector<ChunkSpatialGrid::Entry> placed;
+        for (size_t idx = begin; idx < end; ++idx)
+        {
+            if (first[idx] == first[idx + 1])
+                continue;
+            WorldChunk* existing = _chunks[idx].load(memory_order_acquire);
+            WorldChunk& chunk = existing ? *existing : loadChunk(static_cast<uint32_t>(idx));
+            int x0 = static_cast<int>(idx % _chunksX * CHUNK_SIZE);
+            int y0 = static_cast<int>(idx / _chunksX * CHUNK_SIZE);
+            mt19937_64 chunkRng(mix64(seed ^ (uint64_t(idx) << 32)));
+            chunk.entities.reserve(chunk.entities.size() + first[idx + 1] - first[idx]);
+            chunk.occupancy.reserve(first[idx + 1] - first[idx]);
+            placed.clear();
+
+            for (uint32_t i = first[idx]; i < first[idx + 1]; ++i)
+            {
+                // give up on a chunk with no room left, rather than
+                // trying forever
+                int x, y;
+                size_t tries = 0;
+                do
+                {
+                    x = x0 + tileDist(chunkRng);
+                    y = y0 + tileDist(chunkRng);
+                } while (!place(chunk, x, y) && ++tries < CHUNK_SIZE * CHUNK_SIZE * 4);
+                if (tries == CHUNK_SIZE * CHUNK_SIZE * 4) {
+                    unplaced[idx] = i;
+                    break;
+                }
+
+                // later tries in this chunk need to see it, but the
+                // spatial index can wait
+                const EntityHandle& h = batch[i].handle;
+                CM(PositionData)->getComponent(h)->pos = Position{ x, y, 0 };
+                chunk.entities.push_back(h);
+                chunk.occupancy.insert(WorldChunk::cellIndex(x, y), h);
+                chunk.blocked.set(x % CHUNK_SIZE, y % CHUNK_SIZE, true);
+                placed.push_back(ChunkSpatialGrid::Entry{ h, x, y });
+            }
+            chunk.spatial.insert(placed.data(), placed.size());
+        }
+    });
+
+    // jobs can't throw; the entities that didn't fit are in no chunk, so
+    // they go before anyone can see them
+    string full;
+    size_t dropped = 0;
+    for (uint32_t idx = 0; idx < numChunks; ++idx)
+    {
+        if (unplaced[idx] == first[idx + 1])
+            continue;
+        for (uint32_t i = unplaced[idx]; i < first[idx + 1]; ++i)
+            EM->destroyEntity(batch[i].handle);
+        dropped += first[idx + 1] - unplaced[idx];
+        full += (full.empty() ? "" : ", ") + to_string(idx);
+    }
+    if (!full.empty())
+        throw std::runtime_error("No room to spawn " + to_string(dropped) + " of " + pf.name + " in chunks " + full);
+}
+
+void World::removeEntity(const EntityHandle& h)
+{
+    const PositionData* pd = CM(PositionData)->getComponentRO(h);
+    if (!pd)
+        return;
+
+    WorldChunk& chunk = chunkAt(pd->pos.x, pd->pos.y);
+    auto it = find(begin(chunk.entities), end(chunk.entities), h);
+    if (it != end(chunk.entities)) {
+        chunk.entities.erase(it);
+    }
+    chunk.spatial.remove(h, pd->pos.x, pd->pos.y);
+    chunk.occupancy.remove(WorldChunk::cellIndex(pd->pos.x, pd->pos.y), h);
+    setBlocked(pd->pos.x, pd->pos.y, false);
+}
+
+void World::move(PositionData& pd, int x, int y)
 {
-    Position& pos = e->getComponent<PositionData>()->pos;
+    Position& pos = pd.pos;
     WorldChunk& oldChunk = chunkAt(pos.x, pos.y);
     WorldChunk& newChunk = chunkAt(x, y);
 
     setBlocked(pos.x, pos.y, false);
     setBlocked(x, y, true);
 
-    pos.x = x;
-    pos.y = y;
+    oldChunk.occupancy.remove(WorldChunk::cellIndex(pos.x, pos.y), pd.parent);
+    newChunk.occupancy.insert(WorldChunk::cellIndex(x, y), pd.parent);
 
     if (&oldChunk != &newChunk)
     {
-        auto it = find(begin(oldChunk.entities), end(oldChunk.entities), e->handle);
+        auto it = find(begin(oldChunk.entities), end(oldChunk.entities), pd.parent);
         if (it != end(oldChunk.entities)) {
             oldChunk.entities.erase(it);
         }
-        newChunk.entities.push_back(e->handle);
+        newChunk.entities.push_back(pd.parent);
+
+        oldChunk.spatial.remove(pd.parent, pos.x, pos.y);
+        newChunk.spatial.insert(pd.parent, x, y);
+    }
+    else
+    {
+        oldChunk.spatial.move(pd.parent, pos.x, pos.y, x, y);
     }
+
+    pos.x = x;
+    pos.y = y;
 }
 
-bool World::tryMove(Entity* e, int x, int y)
+bool World::tryMove(PositionData& pd, int x, int y)
 {
     TerrainType t = at(x, y).type;
 
@@ -108,7 +455,7 @@ bool World::tryMove(Entity* e, int x, int y)
     if (getBlocked(x, y))
         return false;
 
-    move(e, x, y);
+    move(pd, x, y);
     return true;
 }
 
@@ -116,25 +463,16 @@ bool World::tryMove(Entity* e, int x, int y)
 vector<EntityHandle> World::getEntitiesAt(int x, int y)
 {
     vector<EntityHandle> rv;
-
-    WorldChunk& chunk = chunkAt(x, y);
-    for (EntityHandle h : chunk.entities)
-    {
-        PositionData* pd = EM->getEntity(h)->getComponent<PositionData>();
-        if (pd) {
-            Position& pos = pd->pos;
-            if (pos.x == x && pos.y == y)
-                rv.push_back(h);
-        }
-    }
-
+    forEachEntityAt(x, y, [&](const EntityHandle& h) {
+        rv.push_back(h);
+    });
     return rv;
 }
 
 bool World::getBlocked(int x, int y)
 {
-    WorldChunk& chunk = chunkAt(x, y);
-    return chunk.blocked(x % CHUNK_SIZE, y % CHUNK_SIZE);
+    WorldChunk* chunk = findChunk(x, y);
+    return chunk && chunk->blocked(x % CHUNK_SIZE, y % CHUNK_SIZE);
 }
 
 void World::setBlocked(int x, int y, bool val)
@@ -143,39 +481,152 @@ void World::setBlocked(int x, int y, bool val)
     chunk.blocked.set(x % CHUNK_SIZE, y % CHUNK_SIZE, val);
 }
 
+uint64_t World::stateHash()
+{
+    uint64_t h = mix64(_tick) ^ EM->stateHash();
+    for (auto& p : CMT->getTable())
+        h = mix64(h ^ p.second->stateHash());
+    return h;
+}
+
 EntityHandle World::findNearestPlant(const Position& src)
 {
-    EntityHandle rv;
+    return findNearest(src, CHUNK_SIZE, componentBit(PlantData::id));
+}
+
+// entries of the spatial cell at global cell coordinates (gx, gy), or
+// nullptr if that's outside the world or not materialized
+const ChunkSpatialGrid::Entry* World::spatialCell(int gx, int gy, size_t& count)
+{
+    int cellsX = static_cast<int>(_width / SPATIAL_CELL_SIZE);
+    int cellsY = static_cast<int>(_height / SPATIAL_CELL_SIZE);
+    if (gx < 0 || gy < 0 || gx >= cellsX || gy >= cellsY)
+        return nullptr;
+
+    uint32_t idx = (gy / SPATIAL_CELLS_PER_CHUNK) * _chunksX + gx / SPATIAL_CELLS_PER_CHUNK;
+    WorldChunk* chunk = _chunks[idx].load(memory_order_acquire);
+    if (!chunk)
+        return nullptr;
+    touch(*chunk);
+
+    const auto& cell = chunk->spatial.cell(gx % SPATIAL_CELLS_PER_CHUNK, gy % SPATIAL_CELLS_PER_CHUNK);
+    count = cell.size();
+    return cell.data();
+}
+
+// Calls fn(gx, gy) for each cell on the square ring at Chebyshev distance r
+// around (cx, cy).
+template<typename Fn>
+static void forEachRingCell(int cx, int cy, int r, Fn fn)
+{
+    if (r == 0) {
+        fn(cx, cy);
+        return;
+    }
+
+    for (int dx = -r; dx <= r; ++dx) {
+        fn(cx + dx, cy - r);
+        fn(cx + dx, cy + r);
+    }
+    for (int dy = -r + 1; dy <= r - 1; ++dy) {
+        fn(cx - r, cy + dy);
+        fn(cx + r, cy + dy);
+    }
+}
+
+// Nothing in ring r can be closer than this (squared). A cell on ring r
+// starts r cells away from the source's cell, and the source can be
+// anywhere inside its own cell.
+static uint64_t ringLowerBound(int r)
+{
+    if (r <= 1)
+        return 0;
+    uint64_t d = static_cast<uint64_t>(r - 1) * SPATIAL_CELL_SIZE + 1;
+    return d * d;
+}
+
+size_t World::findKNearest(const Position& src, size_t k, uint32_t maxRadius, ComponentMask required,
+    vector<EntityHandle>& out)
+{
+    Span<EntityHandle> found = findKNearestFrame(src, k, maxRadius, required);
+    out.assign(found.begin(), found.end());
+    return out.size();
+}
+
+Span<EntityHandle> World::findKNearestFrame(const Position& src, size_t k, uint32_t maxRadius, ComponentMask required)
+{
+    if (k == 0)
+        return Span<EntityHandle>();
 
-    uint32_t nearestDistance = -1;
+    // Room for the result goes first, so the heap is the last thing
+    // allocated and goes back to the arena when it's dropped.
+    Span<EntityHandle> out = FRAME->allocSpan<EntityHandle>(k);
 
-    WorldChunk& chunk = chunkAt(src.x, src.y);
-    for (EntityHandle& eh : chunk.entities)
+    // max-heap of the k best so far; ties go to the lower handle so the
+    // result doesn't depend on bucket order
+    typedef pair<uint64_t, uint64_t> Candidate;
+    FrameVector<Candidate> best;
+    best.reserve(k);
+
+    int cx = src.x / SPATIAL_CELL_SIZE;
+    int cy = src.y / SPATIAL_CELL_SIZE;
+    int rings = static_cast<int>(maxRadius / SPATIAL_CELL_SIZE) + 1;
+    uint64_t r2 = static_cast<uint64_t>(maxRadius) * maxRadius;
+
+    for (int r = 0; r <= rings; ++r)
     {
-        Entity* e = EM->getEntity(eh);
-        if (e->hasComponent<PlantData>()) {
-            Position& pos = e->getComponent<PositionData>()->pos;
-            uint32_t d = src.distance_squared(pos);
-            if (d < nearestDistance) {
-                nearestDistance = d;
-                rv = e->handle;
+        if (best.size() == k && ringLowerBound(r) > best.front().first)
+            break;
+
+        forEachRingCell(cx, cy, r, [&](int gx, int gy) {
+            size_t n = 0;
+            const ChunkSpatialGrid::Entry* entries = spatialCell(gx, gy, n);
+            for (size_t i = 0; i < n; ++i)
+            {
+                const ChunkSpatialGrid::Entry& e = entries[i];
+                uint64_t d = src.distance_squared(Position{ e.x, e.y, 0 });
+                if (d > r2)
+                    continue;
+
+                Candidate c(d, e.handle.raw);
+                if (best.size() == k && !(c < best.front()))
+                    continue;
+                if ((EM->getEntity(e.handle)->allComponents() & required) != required)
+                    continue;
+
+                if (best.size() == k) {
+                    pop_heap(best.begin(), best.end());
+                    best.pop_back();
+                }
+                best.push_back(c);
+                push_heap(best.begin(), best.end());
             }
-        }
+        });
     }
 
-    return rv;
+    sort_heap(best.begin(), best.end());
+    for (size_t i = 0; i < best.size(); ++i)
+        out[i].raw = best[i].second;
+    return Span<EntityHandle>(out.data(), best.size());
+}
+
+EntityHandle World::findNearest(const Position& src, uint32_t maxRadius, ComponentMask required)
+{
+    Span<EntityHandle> found = findKNearestFrame(src, 1, maxRadius, required);
+    return found.empty() ? EntityHandle() : found[0];
 }
 
 void World::inspect()
 {
     size_t numEntities = 0;
     size_t numChunks = 0;
-    for (uint32_t y = 0; y < _chunks.getHeight(); y++)
+    for (uint32_t i = 0; i < getNumChunks(); i++)
     {
-        for (uint32_t x = 0; x < _chunks.getWidth(); x++)
+        WorldChunk* chunk = _chunks[i].load();
+        if (chunk)
         {
             numChunks++;
-            numEntities += _chunks(x, y).entities.size();
+            numEntities += chunk->entities.size();
         }
     }
     cout << numChunks << "\t";
@@ -184,11 +635,6 @@ void World::inspect()
 
 void World::populate()
 {
-    uniform_int_distribution<int> distx(0, static_cast<int>(getWidth() - 1));
-    uniform_int_distribution<int> disty(0, static_cast<int>(getHeight() - 1));
-    mt19937 rng;
-    rng.seed(12345);
-
     size_t numActors = 50000;
     size_t numPlants = 500000;
 
@@ -201,93 +647,130 @@ void World::populate()
     CM(PathfindingData)->reserve(numActors);
     CM(PlantData)->reserve(numPlants);
 
-    for (size_t i = 0; i < numActors; i++) {
-        Entity* e = EM->makeEntity();
-
-        Position& pos = e->addComponent<PositionData>()->pos;
-        e->addComponent<MovableData>();
-        e->addComponent<CreatureData>();
-        e->addComponent<InventoryData>();
-        e->addComponent<ActorData>();
-
-        int rx, ry;
-        bool ok = false;
-        do
-        {
-            rx = distx(rng);
-            ry = disty(rng);
+    Prefab* actor = EM->makePrefab("actor");
+    actor->addComponent<PositionData>(false);
+    actor->addComponent<MovableData>(false);
+    actor->addComponent<CreatureData>();
+    actor->addComponent<InventoryData>(false);
+    actor->addComponent<ActorData>(false);
+    actor->addComponent<PathfindingData>(false);
+
+    // plants all grow alike, so they share the prefab's GrowthData
+    Prefab* plant = EM->makePrefab("plant");
+    plant->addComponent<PositionData>(false);
+    plant->addComponent<PlantData>();
+    plant->addComponent<GrowthData>();
+
+    // actors one to a tile; plants can share, with each other and actors
+    spawnBatch(*actor, numActors, 12345, [](const WorldChunk& chunk, int x, int y) {
+        return chunk.terrain(x % CHUNK_SIZE, y % CHUNK_SIZE).type == TerrainType::Grass &&
+            !chunk.occupancy.has(WorldChunk::cellIndex(x, y));
+    });
+    spawnBatch(*plant, numPlants, 67890, [](const WorldChunk& chunk, int x, int y) {
+        return chunk.terrain(x % CHUNK_SIZE, y % CHUNK_SIZE).type == TerrainType::Grass;
+    });
+}
 
-            if (this->at(rx, ry).type != TerrainType::Grass)
-                continue;
 
-            vector<EntityHandle> entities = this->getEntitiesAt(rx, ry);
-            if (entities.size() > 0)
-                continue;
+Game::Game(shared_ptr<World> world)
+{
+    _time = world->getTick();
+    _world = world;
 
-            ok = true;
-        } while (!ok);
+    _pathfinder.reset(new Pathfinder(*_world));
+    _flowFields.reset(new FlowFields(*_world, *_pathfinder));
 
-        pos.x = rx;
-        pos.y = ry;
-        this->addEntity(e);
+    // in this order, so a field an actor starts following this tick is
+    // there when it takes its first step
+    _systems.emplace_back(new ActorSystem(_world));
+    _systems.emplace_back(new PathfindingSystem(_world, *_pathfinder, *_flowFields));
+    _systems.emplace_back(new MovableSystem(_world, *_flowFields));
+    _timers.emplace_back(new TimingWheel(_time));
+    _systems.emplace_back(new PlantSystem(_world, *_timers.back()));
+    _timers.emplace_back(new TimingWheel(_time));
+    _systems.emplace_back(new CreatureSystem(_world, *_timers.back()));
+
+    _scheduler.reset(new Scheduler);
+    for (auto& sys : _systems) {
+        _scheduler->add(sys.get());
     }
+}
 
-    for (size_t i = 0; i < numPlants; i++) {
-        Entity* e = EM->makeEntity();
-
-        Position& pos = e->addComponent<PositionData>()->pos;
-        e->addComponent<PlantData>();
-
-        int rx, ry;
-        bool ok = false;
-        do
-        {
-            rx = distx(rng);
-            ry = disty(rng);
-
-            if (this->at(rx, ry).type != TerrainType::Grass)
-                continue;
-
-            ok = true;
-        } while (!ok);
+Game::~Game()
+{
+    waitForCheckpoint();
+}
 
-        pos.x = rx;
-        pos.y = ry;
-        this->addEntity(e);
-    }
+size_t Game::getPendingWakeups() const
+{
+    size_t total = 0;
+    for (auto& timers : _timers)
+        total += timers->size();
+    return total;
 }
 
+PathfinderStats Game::getPathfinderStats() const
+{
+    return _pathfinder->getStats();
+}
 
-Game::Game(shared_ptr<World> world)
+FlowFieldStats Game::getFlowFieldStats() const
 {
-    _time = 0;
-    _world = world;
+    return _flowFields->getStats();
+}
 
-    _systems.emplace_back(new MovableSystem(_world));
-    _systems.emplace_back(new ActorSystem(_world));
-    _systems.emplace_back(new PlantSystem(_world));
-    _systems.emplace_back(new CreatureSystem(_world));
+void Game::setStateHashing(bool enabled)
+{
+    _stateHashing = enabled;
+    _hashes.clear();
+}
 
-#ifdef _OPENMP
-    omp_set_dynamic(1);
-    omp_set_num_threads(omp_get_num_procs());
-#endif
+void Game::startRecording(const string& snapshotPath, const string& logPath)
+{
+    _recorder.reset(new ReplayRecorder(_world, snapshotPath, logPath));
 }
 
-Game::~Game()
+void Game::stopRecording()
 {
+    _recorder.reset();
 }
 
 void Game::tick()
 {
-    for (auto& sys : _systems) {
-        sys->tick();
-    }
+    auto t0 = high_resolution_clock::now();
+    bool checkpointing = isCheckpointing();
 
-    for (auto& sys : _systems) {
-        sys->waitForTick();
-    }
+    // lay components out by archetype before the systems walk them
+    EM->sortByArchetype();
+    _pathfinder->refresh();
+    _flowFields->refresh();
+    _world->growCommandBuffers();
+
+    _scheduler->run();
+
+    _world->applyCommands();
 
-    // TODO: remove invalid Entity's components
     _time++;
+    _world->setTick(_time);
+    _world->updatePaging(_time);
+
+    // paths dropped this tick, by the systems or along with their entities
+    PATHS->collect();
+    FRAME->reset();
+
+    if (_stateHashing)
+        _hashes.push_back(_world->stateHash());
+    if (_recorder)
+        _recorder->record(_time);
+    if (checkpointing)
+        pollCheckpoint(false);
+    if (_checkpointInterval && _time % _checkpointInterval == 0)
+        checkpoint(_checkpointPath);
+
+    // the tick that starts a checkpoint pays for the fork, so it counts
+    double seconds = duration_cast<duration<double>>(high_resolution_clock::now() - t0).count();
+    if (checkpointing || isCheckpointing())
+        _checkpointStats.ticksDuring.add(seconds);
+    else
+        _checkpointStats.ticksIdle.add(seconds);
 }
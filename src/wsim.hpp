@@ -1,17 +1,54 @@
 #pragma once
 #include "common.hpp"
+#include "framearena.hpp"
 
 #define EM EntityManager::getSingleton()
 #define CM(T) ComponentManager<T>::getSingleton()
 #define CMT CMTable::getSingleton()
 #define PF PrefabFactory::getSingleton()
 
+// A set of entities that have exactly the same components. When the
+// ComponentManagers are sorted by archetype, each archetype's components
+// form one contiguous column per component type, all in the same entity
+// order, so systems can walk several components in lockstep.
+struct Archetype
+{
+    ComponentMask mask;
+    vector<EntityHandle> entities;
+};
+
 class CMInterface
 {
 public:
-    virtual void destroyComponent(ComponentHandle h) = 0;
+    virtual void destroyComponent(const EntityHandle& h) = 0;
     virtual void clear() = 0;
-    virtual void sort() = 0;
+    virtual void sort(const vector<Archetype>& archetypes) = 0;
+    virtual bool isSorted() const = 0;
+
+    // serialize h's component, or read one back and add it to h; with
+    // discard set, the bytes are skipped and nothing is added
+    virtual void writeComponent(const EntityHandle& h, vector<char>& out) = 0;
+    virtual void readComponent(const EntityHandle& h, const char*& in, bool discard) = 0;
+    virtual size_t componentSize() const = 0;
+
+    // add a copy of the component at index prefabComponent of the pool's
+    // prefab storage to each of count entities
+    virtual void instantiate(const EntityHandle* handles, size_t count, uint16_t prefabComponent) = 0;
+
+    // the whole pool, dense array and sparse index; see snapshot.cpp
+    virtual void writeSnapshot(vector<char>& out) const = 0;
+    virtual void readSnapshot(const char*& in) = 0;
+
+    // sum of a hash of each component and its entity, so it doesn't depend
+    // on the order of the dense array
+    virtual uint64_t stateHash() const = 0;
+
+    // For the replay log: calls fn(offset, bytes, size) for each stretch of
+    // writeSnapshot()'s output that may have been written since the last
+    // call, and forgets them. Returns false instead, without calling fn, if
+    // more than that may have changed: components were added, removed or
+    // sorted, or written in a pool that isn't plain data.
+    virtual bool takeChanges(const function<void(size_t, const char*, size_t)>& fn) = 0;
 };
 
 // map ComponentIds to ComponentManagers
@@ -45,6 +82,10 @@ private:
     map<ComponentId, CMInterface*> _table;
 };
 
+// Sparse set: components are packed in a dense array, and a sparse array
+// indexed by entity index maps each entity to its slot in the dense array.
+// Lookup, insert and remove are all O(1). Removal swaps the last component
+// into the hole, so the dense order is not stable.
 template<typename T>
 class ComponentManager : public CMInterface
 {
@@ -59,26 +100,176 @@ public:
         return instance.get();
     }
 
-    ComponentHandle addComponent(EntityHandle& h)
+    T* addComponent(const EntityHandle& h)
     {
+        uint32_t idx = h.data.index;
+        if (idx >= _sparse.size())
+            _sparse.resize(idx + 1, INVALID_COMPONENT);
+
+        if (_sparse[idx] != INVALID_COMPONENT) {
+            markDirty(_sparse[idx]);
+            return &_components[_sparse[idx]];
+        }
+
+        _sorted = false;
+        _reshaped = true;
+        _sparse[idx] = static_cast<ComponentHandle>(_components.size());
         _components.emplace_back();
-        _components[_components.size() - 1].parent = h;
-        return static_cast<ComponentHandle>(_components.size() - 1);
+        _components.back().parent = h;
+        if (_trackAdded)
+            _added.push_back(h);
+        return &_components.back();
+    }
+
+    // From now on, remember which entities get a component, whether new
+    // or read back from a page or snapshot. Everything already in the pool
+    // counts as added.
+    void trackAdded()
+    {
+        _trackAdded = true;
+        _added.clear();
+        for (const T& c : _components)
+            _added.push_back(c.parent);
+    }
+
+    vector<EntityHandle> takeAdded()
+    {
+        vector<EntityHandle> rv;
+        rv.swap(_added);
+        return rv;
+    }
+
+    inline bool hasComponent(const EntityHandle& h) const
+    {
+        uint32_t idx = h.data.index;
+        return idx < _sparse.size() && _sparse[idx] != INVALID_COMPONENT;
+    }
+
+    // for writing; see markDirty()
+    inline T* getComponent(const EntityHandle& h)
+    {
+        uint32_t idx = h.data.index;
+        if (idx >= _sparse.size() || _sparse[idx] == INVALID_COMPONENT)
+            return nullptr;
+        markDirty(_sparse[idx]);
+        return &_components[_sparse[idx]];
+    }
+
+    inline const T* getComponentRO(const EntityHandle& h) const
+    {
+        uint32_t idx = h.data.index;
+        if (idx >= _sparse.size() || _sparse[idx] == INVALID_COMPONENT)
+            return nullptr;
+        return &_components[_sparse[idx]];
     }
 
-    T* getComponent(ComponentHandle h)
+    inline const T* getComponent(const EntityHandle& h) const
     {
-        return &_components[static_cast<size_t>(h)];
+        return getComponentRO(h);
     }
 
-    uint16_t addPrefabComponent(uint16_t pfhandle)
+    // Notes that count components from dense slot first on may have been
+    // written, for takeChanges(). Whatever hands out a T* that isn't const
+    // calls it; the const accessors don't. Thread safe.
+    void markDirty(size_t first, size_t count = 1)
     {
+        if (count == 0)
+            return;
+        size_t last = (first + count - 1) / DIRTY_BLOCK;
+        if (last / 64 >= _dirtyWords) {
+            if (!_reshaped.load(memory_order_relaxed))
+                _reshaped = true;
+            return;
+        }
+        for (size_t b = first / DIRTY_BLOCK; b <= last; ++b)
+        {
+            uint64_t bit = uint64_t(1) << (b % 64);
+            if (!(_dirty[b / 64].load(memory_order_relaxed) & bit))
+                _dirty[b / 64].fetch_or(bit, memory_order_relaxed);
+        }
+    }
+
+    // dense index of h's component, or INVALID_COMPONENT
+    inline ComponentHandle indexOf(const EntityHandle& h) const
+    {
+        uint32_t idx = h.data.index;
+        return idx < _sparse.size() ? _sparse[idx] : INVALID_COMPONENT;
+    }
+
+    void removeComponent(const EntityHandle& h)
+    {
+        uint32_t idx = h.data.index;
+        if (idx >= _sparse.size() || _sparse[idx] == INVALID_COMPONENT)
+            return;
+
+        _sorted = false;
+        _reshaped = true;
+        ComponentHandle slot = _sparse[idx];
+        ComponentHandle last = static_cast<ComponentHandle>(_components.size() - 1);
+        ComponentIO<T>::release(_components[slot]);
+        if (slot != last) {
+            _components[slot] = std::move(_components[last]);
+            _sparse[_components[slot].parent.data.index] = slot;
+        }
+        _components.pop_back();
+        _sparse[idx] = INVALID_COMPONENT;
+    }
+
+    // a new component owned by a prefab rather than an entity; returns its
+    // index for getPrefabComponent()
+    uint16_t addPrefabComponent()
+    {
+        _reshaped = true;
         _prefabComponents.emplace_back();
         return static_cast<uint16_t>(_prefabComponents.size() - 1);
     }
 
+    // only valid until the next addPrefabComponent()
+    T* getPrefabComponent(uint16_t idx)
+    {
+        _reshaped = true;
+        return &_prefabComponents[idx];
+    }
+
+    const T* getPrefabComponent(uint16_t idx) const
+    {
+        return &_prefabComponents[idx];
+    }
+
+    // grows the sparse and dense arrays once for the lot, rather than once
+    // an entity
+    void instantiate(const EntityHandle* handles, size_t count, uint16_t prefabComponent) override
+    {
+        uint32_t top = 0;
+        for (size_t i = 0; i < count; ++i)
+            top = std::max(top, handles[i].data.index);
+        if (count > 0 && top >= _sparse.size())
+            _sparse.resize(top + 1, INVALID_COMPONENT);
+        _components.reserve(_components.size() + count);
+
+        _reshaped = true;
+        const T& src = _prefabComponents[prefabComponent];
+        for (size_t i = 0; i < count; ++i)
+        {
+            const EntityHandle& h = handles[i];
+            uint32_t idx = h.data.index;
+            if (_sparse[idx] == INVALID_COMPONENT) {
+                _sparse[idx] = static_cast<ComponentHandle>(_components.size());
+                _components.emplace_back();
+                if (_trackAdded)
+                    _added.push_back(h);
+            }
+
+            T& c = _components[_sparse[idx]];
+            copyComponent(src, c, Plain());
+            c.parent = h;
+        }
+        _sorted = false;
+    }
+
     auto begin()
     {
+        markDirty(0, _components.size());
         return _components.begin();
     }
 
@@ -87,6 +278,21 @@ public:
         return _components.end();
     }
 
+    auto begin() const
+    {
+        return _components.begin();
+    }
+
+    auto end() const
+    {
+        return _components.end();
+    }
+
+    size_t size() const
+    {
+        return _components.size();
+    }
+
     void reserve(size_t num)
     {
         _components.reserve(num);
@@ -94,65 +300,351 @@ public:
 
     void clear() override
     {
+        for (T& c : _components)
+            ComponentIO<T>::release(c);
+        for (T& c : _prefabComponents)
+            ComponentIO<T>::release(c);
         _components.clear();
+        _prefabComponents.clear();
+        _sparse.clear();
+        _columns.clear();
+        _added.clear();
+        _sorted = false;
+        _reshaped = true;
+    }
+
+    // Reorder the dense array so each archetype that has a T is one
+    // contiguous run, in the archetype's entity order.
+    void sort(const vector<Archetype>& archetypes) override
+    {
+        ComponentMask bit = componentBit(T::id);
+        vector<T, AlignedAllocator<T>> sorted;
+        sorted.reserve(_components.size());
+
+        _columns.assign(archetypes.size(), INVALID_COMPONENT);
+        for (size_t a = 0; a < archetypes.size(); ++a)
+        {
+            if (!(archetypes[a].mask & bit))
+                continue;
+
+            _columns[a] = static_cast<ComponentHandle>(sorted.size());
+            for (const EntityHandle& h : archetypes[a].entities)
+                sorted.push_back(std::move(_components[_sparse[h.data.index]]));
+        }
+        assert(sorted.size() == _components.size());
+
+        _components.swap(sorted);
+        for (size_t i = 0; i < _components.size(); ++i)
+            _sparse[_components[i].parent.data.index] = static_cast<ComponentHandle>(i);
+        _sorted = true;
+        _reshaped = true;
+    }
+
+    bool isSorted() const override
+    {
+        return _sorted;
+    }
+
+    void writeComponent(const EntityHandle& h, vector<char>& out) override
+    {
+        ComponentIO<T>::write(out, *getComponentRO(h));
+    }
+
+    void readComponent(const EntityHandle& h, const char*& in, bool discard) override
+    {
+        T tmp;
+        ComponentIO<T>::read(in, tmp);
+        if (discard) {
+            ComponentIO<T>::release(tmp);
+            return;
+        }
+
+        T* c = addComponent(h);
+        ComponentIO<T>::release(*c);
+        *c = std::move(tmp);
+        c->parent = h;
+    }
+
+    size_t componentSize() const override
+    {
+        return sizeof(T);
     }
 
-    void sort() override
+    uint64_t stateHash() const override
     {
+        atomic<uint64_t> sum{0};
+        JOBS->parallelFor(0, _components.size(), 4096, [&](size_t begin, size_t end) {
+            uint64_t partial = 0;
+            vector<char> scratch;
+            for (size_t i = begin; i < end; ++i)
+                partial += hashComponent(_components[i], scratch, Plain());
+            sum += partial;
+        });
+
+        uint64_t prefabs = 0;
+        vector<char> scratch;
+        for (const T& c : _prefabComponents)
+            prefabs = mix64(prefabs ^ hashComponent(c, scratch, Plain()));
+        return mix64(sum ^ prefabs ^ static_cast<uint64_t>(T::id));
     }
 
-    void destroyComponent(ComponentHandle h) override
+    // Plain-data pools are stored as their raw, cache line aligned arrays,
+    // so loading one is a single copy. Prefab components follow, one at a
+    // time.
+    void writeSnapshot(vector<char>& out) const override
     {
-        // TODO: mark as invalid
+        writeBytes(out, static_cast<uint32_t>(sizeof(T)));
+        writeBytes(out, static_cast<uint64_t>(_components.size()));
+        writeBytes(out, static_cast<uint64_t>(_sparse.size()));
+        padBytes(out, CACHE_LINE_SIZE);
+        writeDense(out, Plain());
+        padBytes(out, CACHE_LINE_SIZE);
+        writeBytes(out, _sparse.data(), _sparse.size());
+        padBytes(out, CACHE_LINE_SIZE);
+        writeBytes(out, static_cast<uint32_t>(_prefabComponents.size()));
+        for (const T& c : _prefabComponents)
+            ComponentIO<T>::write(out, c);
+        padBytes(out, CACHE_LINE_SIZE);
     }
 
-    vector<T>& getData()
+    void readSnapshot(const char*& in) override
     {
+        uint32_t size;
+        uint64_t count, sparse;
+        readBytes(in, size);
+        readBytes(in, count);
+        readBytes(in, sparse);
+        if (size != sizeof(T))
+            throw std::runtime_error("Snapshot component size mismatch");
+
+        alignPointer(in, CACHE_LINE_SIZE);
+        readDense(in, count, Plain());
+        alignPointer(in, CACHE_LINE_SIZE);
+        const ComponentHandle* src = reinterpret_cast<const ComponentHandle*>(in);
+        _sparse.assign(src, src + sparse);
+        in += sparse * sizeof(ComponentHandle);
+        alignPointer(in, CACHE_LINE_SIZE);
+
+        uint32_t prefabs;
+        readBytes(in, prefabs);
+        for (T& c : _prefabComponents)
+            ComponentIO<T>::release(c);
+        _prefabComponents.resize(prefabs);
+        for (T& c : _prefabComponents)
+            ComponentIO<T>::read(in, c);
+        alignPointer(in, CACHE_LINE_SIZE);
+
+        _columns.clear();
+        _sorted = false;
+        _reshaped = true;
+        if (_trackAdded)
+            trackAdded();
+    }
+
+    bool takeChanges(const function<void(size_t, const char*, size_t)>& fn) override
+    {
+        bool reshaped = _reshaped.exchange(false);
+        size_t words = _components.size() / DIRTY_BLOCK / 64 + 1;
+        if (reshaped || words > _dirtyWords) {
+            // room for every slot there is until the next reshape
+            _dirty.reset(new atomic<uint64_t>[words]);
+            _dirtyWords = words;
+            for (size_t w = 0; w < words; ++w)
+                _dirty[w] = 0;
+            return false;
+        }
+        return takeChanges(fn, Plain());
+    }
+
+    // first component of archetype a's column, which has n; only valid
+    // while sorted
+    T* column(size_t a, size_t n)
+    {
+        markDirty(_columns[a], n);
+        return &_components[_columns[a]];
+    }
+
+    const T* column(size_t a, size_t) const
+    {
+        return &_components[_columns[a]];
+    }
+
+    void destroyComponent(const EntityHandle& h) override
+    {
+        removeComponent(h);
+    }
+
+    vector<T, AlignedAllocator<T>>& getData()
+    {
+        markDirty(0, _components.size());
         return _components;
     }
 
+    const vector<T, AlignedAllocator<T>>& getData() const
+    {
+        return _components;
+    }
+
+    // for writing through a pointer a const accessor handed out
+    void markDirty(const T* c)
+    {
+        markDirty(c - _components.data());
+    }
+
 private:
+    // whether components can be copied to and from bytes as they are
+    typedef integral_constant<bool, ComponentIO<T>::plain> Plain;
+
+    // dense slots per bit of _dirty
+    const static size_t DIRTY_BLOCK = 64;
+
+    // where writeSnapshot() puts the dense array
+    const static size_t DENSE_OFFSET = CACHE_LINE_SIZE;
+
     ComponentManager() {}
-    vector<T> _components;
-    vector<T> _prefabComponents;
-};
 
-struct Prefab
-{
-    uint16_t handle;
-    CompactMap<ComponentId, uint16_t> components;
+    bool takeChanges(const function<void(size_t, const char*, size_t)>& fn, true_type)
+    {
+        const char* dense = reinterpret_cast<const char*>(_components.data());
+        for (size_t w = 0; w < _dirtyWords; ++w)
+        {
+            for (uint64_t bits = _dirty[w].exchange(0, memory_order_relaxed); bits; bits &= bits - 1)
+            {
+                size_t first = (w * 64 + ctz64(bits)) * DIRTY_BLOCK;
+                size_t end = std::min(first + DIRTY_BLOCK, _components.size());
+                if (first < end)
+                    fn(DENSE_OFFSET + first * sizeof(T), dense + first * sizeof(T), (end - first) * sizeof(T));
+            }
+        }
+        return true;
+    }
 
-    Prefab(uint16_t h)
+    // components that aren't plain data don't have fixed places in the
+    // snapshot, so a write anywhere means writing the lot
+    bool takeChanges(const function<void(size_t, const char*, size_t)>&, false_type)
     {
-        handle = h;
+        bool any = false;
+        for (size_t w = 0; w < _dirtyWords; ++w)
+            any |= _dirty[w].exchange(0, memory_order_relaxed) != 0;
+        return !any;
     }
 
-    Prefab(const Prefab& copy) = delete;
+    static uint64_t hashComponent(const T& c, vector<char>&, true_type)
+    {
+        return hashBytes(&c, sizeof(T), c.parent.raw);
+    }
+
+    static uint64_t hashComponent(const T& c, vector<char>& scratch, false_type)
+    {
+        scratch.clear();
+        ComponentIO<T>::write(scratch, c);
+        return hashBytes(scratch.data(), scratch.size(), c.parent.raw);
+    }
+
+    static void copyComponent(const T& src, T& dst, true_type)
+    {
+        dst = src;
+    }
+
+    // through its serialized form, so whatever it owns is copied too
+    static void copyComponent(const T& src, T& dst, false_type)
+    {
+        vector<char> scratch;
+        ComponentIO<T>::write(scratch, src);
+        const char* in = scratch.data();
+        T tmp;
+        ComponentIO<T>::read(in, tmp);
+        ComponentIO<T>::release(dst);
+        dst = std::move(tmp);
+    }
+
+    void writeDense(vector<char>& out, true_type) const
+    {
+        writeBytes(out, _components.data(), _components.size());
+    }
+
+    void writeDense(vector<char>& out, false_type) const
+    {
+        for (const T& c : _components)
+            ComponentIO<T>::write(out, c);
+    }
 
-    Prefab(Prefab&& src)
+    void readDense(const char*& in, size_t count, true_type)
     {
-        components = std::move(src.components);
-        handle = std::move(src.handle);
+        const T* src = reinterpret_cast<const T*>(in);
+        _components.assign(src, src + count);
+        in += count * sizeof(T);
     }
 
-    Prefab& operator=(Prefab& src)
+    void readDense(const char*& in, size_t count, false_type)
     {
-        components = std::move(src.components);
-        handle = std::move(src.handle);
-        return *this;
+        for (T& c : _components)
+            ComponentIO<T>::release(c);
+        _components.resize(count);
+        for (T& c : _components)
+            ComponentIO<T>::read(in, c);
     }
 
+    vector<T, AlignedAllocator<T>> _components;
+    vector<ComponentHandle> _sparse;
+    vector<ComponentHandle> _columns; // archetype index -> first dense slot
+    bool _sorted = false;
+    bool _trackAdded = false;
+    vector<EntityHandle> _added;
+    vector<T, AlignedAllocator<T>> _prefabComponents;  // zeroed like the pool, so padding hashes alike
+    unique_ptr<atomic<uint64_t>[]> _dirty;  // bit per DIRTY_BLOCK dense slots written since takeChanges()
+    size_t _dirtyWords = 0;
+    atomic<bool> _reshaped{true};   // changed in a way _dirty doesn't cover
+};
+
+// The pool a query over T reads from. When T is const the pool is too,
+// so its accessors don't mark anything dirty for the replay log.
+template<typename T>
+using PoolOf = typename conditional<is_const<T>::value,
+    const ComponentManager<typename remove_const<T>::type>, ComponentManager<T>>::type;
+
+template<typename T>
+PoolOf<T>* poolOf()
+{
+    return CM(typename remove_const<T>::type);
+}
+
+// A template entities can be spawned from. Its components live in each
+// pool's prefab storage, and entities spawned from it share the ones
+// marked shared: they read the prefab's through getComponentRO(), and only
+// get a copy of their own the first time they ask to write one. The rest
+// are copied into every entity as it spawns.
+struct Prefab
+{
+    uint16_t handle;            // EntityManager::getPrefab(); 0 is no prefab
+    string name;
+    CompactMap<ComponentId, uint16_t> components;  // index in each pool's prefab storage
+    ComponentMask shared = 0;
+    ComponentMask copied = 0;
+
+    Prefab(uint16_t h, const string& n)
+    {
+        handle = h;
+        name = n;
+    }
+
+    Prefab(const Prefab& copy) = delete;
+
+    // Shared components stay with the prefab until an entity writes to
+    // its own. Scheduled components are copied by default, since systems
+    // only wake what's in their own pool.
     template<typename T>
-    T* addComponent()
+    T* addComponent(bool share = !is_base_of<ScheduledComponent, T>::value)
     {
-        components.add(T::id, CM(T)->addPrefabComponent(handle));
+        components.add(T::id, CM(T)->addPrefabComponent());
+        (share ? shared : copied) |= componentBit(T::id);
         return getComponent<T>();
     }
 
     template<typename T>
-    bool hasComponent()
+    bool hasComponent() const
     {
-        return components.has(T::id);
+        return ((shared | copied) & componentBit(T::id)) != 0;
     }
 
     template<typename T>
@@ -161,7 +653,16 @@ struct Prefab
         if (!hasComponent<T>())
             return nullptr;
         else
-            return reinterpret_cast<T*>(CM(T)->getPrefabComponent(components.get(T::id)));
+            return CM(T)->getPrefabComponent(components.get(T::id));
+    }
+
+    template<typename T>
+    const T* getComponentRO() const
+    {
+        if (!hasComponent<T>())
+            return nullptr;
+        else
+            return poolOf<const T>()->getPrefabComponent(components.get(T::id));
     }
 };
 
@@ -170,7 +671,7 @@ struct Entity
     bool valid = true;
     uint16_t prefabParent = 0;
     EntityHandle handle;
-    CompactMap<ComponentId, ComponentHandle> components;
+    ComponentMask components = 0;   // the ones it has its own copy of
 
     Entity(EntityHandle& e, uint16_t prefab=0)
     {
@@ -178,49 +679,42 @@ struct Entity
         prefabParent = prefab;
     }
 
-    Entity(const Prefab& pf)
-    {
-        // TODO: init scheduled components, which will force copies
-    }
-
     Entity(const Entity& copy) = delete;
 
     Entity(Entity&& src)
     {
-        valid = std::move(src.valid);
-        handle = std::move(src.handle);
-        components = std::move(src.components);
+        valid = src.valid;
+        prefabParent = src.prefabParent;
+        handle = src.handle;
+        components = src.components;
+        src.components = 0;
     }
 
-    ~Entity()
-    {
-        for (auto& p : components)
-        {
-            CMTable::getSingleton()->get(p.first)->destroyComponent(p.second);
-        }
-    }
+    template<typename T>
+    T* addComponent();
 
     template<typename T>
-    T* addComponent()
-    {
-        components.add(T::id, CM(T)->addComponent(handle));
-        return getComponent<T>();
-    }
+    void removeComponent();
 
+    // whether it has its own T; it may still inherit one from its prefab
     template<typename T>
-    bool hasComponent()
+    bool hasComponent() const
     {
-        return components.has(T::id);
+        return (components & componentBit(T::id)) != 0;
     }
 
+    // its own T, or else its prefab's
     template<typename T>
-    T* getComponent()
-    {
-        if (!hasComponent<T>())
-            return nullptr;
-        else
-            return reinterpret_cast<T*>(CM(T)->getComponent(components.get(T::id)));
-    }
+    const T* getComponentRO() const;
+
+    // the components it has its own copy of, and the ones it shares with
+    // its prefab
+    ComponentMask allComponents() const;
+
+    // Its own T, copied from its prefab's first if it only inherits one.
+    // Copying adds a component, so don't call this while systems run.
+    template<typename T>
+    T* getComponent();
 };
 
 class EntityManager
@@ -240,12 +734,68 @@ public:
 
     Entity* makeEntity(const string& prefabName="")
     {
-        uint32_t idx = static_cast<uint32_t>(_entities.size());
-        EntityHandle eh{idx, 0};
-        uint16_t pf = 0;
-        if (prefabName != "") {
-            pf = _prefabNames[prefabName];
+        Prefab* pf = getPrefab(prefabName);
+        return pf ? makeEntity(*pf) : makeEntity(uint16_t(0));
+    }
+
+    // Spawns an entity from pf, copying in the components that aren't
+    // shared.
+    Entity* makeEntity(const Prefab& pf)
+    {
+        Entity* e = makeEntity(pf.handle);
+        for (auto& p : pf.components)
+        {
+            if (pf.copied & componentBit(p.first)) {
+                CMT->get(p.first)->instantiate(&e->handle, 1, p.second);
+                e->components |= componentBit(p.first);
+            }
+        }
+        return e;
+    }
+
+    // Spawns count entities from pf at once, each pool filling in its
+    // share for all of them in one go. They take new slots at the end of
+    // the table, so they're contiguous and in handle order; free slots are
+    // left to makeEntity(). The span is good until the next entity is made.
+    Span<Entity> spawnBatch(const Prefab& pf, size_t count)
+    {
+        markChanged();
+        uint32_t first = static_cast<uint32_t>(_entities.size());
+        vector<EntityHandle> handles(count);
+        _entities.reserve(first + count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            EntityHandle eh{static_cast<uint32_t>(first + i), 1};
+            _entities.emplace_back(eh, pf.handle);
+            _entities.back().components = pf.copied;
+            handles[i] = eh;
         }
+
+        for (auto& p : pf.components)
+        {
+            if (pf.copied & componentBit(p.first))
+                CMT->get(p.first)->instantiate(handles.data(), count, p.second);
+        }
+        return Span<Entity>(_entities.data() + first, count);
+    }
+
+    Entity* makeEntity(uint16_t pf)
+    {
+        markChanged();
+        if (!_freeList.empty())
+        {
+            // recycle a slot; its counter was already bumped on destruction
+            uint32_t idx = _freeList.back();
+            _freeList.pop_back();
+            Entity& e = _entities[idx];
+            e.valid = true;
+            e.prefabParent = pf;
+            e.components = 0;
+            return &e;
+        }
+
+        uint32_t idx = static_cast<uint32_t>(_entities.size());
+        EntityHandle eh{idx, 1};
         _entities.emplace_back(eh, pf);
         return &_entities[idx];
     }
@@ -255,74 +805,916 @@ public:
         return &_entities[h.data.index];
     }
 
+    // false if h was never issued, or its entity has been destroyed or
+    // marked for destruction
+    bool isValid(const EntityHandle& h) const
+    {
+        uint32_t idx = h.data.index;
+        return idx < _entities.size() && _entities[idx].handle == h && _entities[idx].valid;
+    }
+
+    // Removes all of the entity's components and recycles its slot. Stale
+    // handles are ignored.
+    void destroyEntity(const EntityHandle& h)
+    {
+        uint32_t idx = h.data.index;
+        if (idx >= _entities.size() || _entities[idx].handle != h)
+            return;
+
+        markChanged();
+        Entity& e = _entities[idx];
+        auto& table = CMTable::getSingleton()->getTable();
+        for (auto& p : table) {
+            if (e.components & componentBit(p.first))
+                p.second->destroyComponent(h);
+        }
+
+        e.components = 0;
+        e.valid = false;
+        if (++e.handle.data.counter == 0)
+            e.handle.data.counter = 1;
+        _freeList.push_back(idx);
+    }
+
+    size_t size() const
+    {
+        return _entities.size() - _freeList.size();
+    }
+
     void reserve(size_t num)
     {
         _entities.reserve(num);
     }
 
+    // components are keyed by entity index, so they go too, and so do
+    // prefabs
     void clear()
     {
+        markChanged();
+        _entities.clear();
+        _freeList.clear();
+        _archetypes.clear();
+        _prefabs.clear();
+        _prefabNames.clear();
+        for (auto& p : CMTable::getSingleton()->getTable()) {
+            p.second->clear();
+        }
+    }
+
+    // Group entities by component set and sort every ComponentManager to
+    // match. Does nothing if no components were added or removed since the
+    // last call. Must not run concurrently with systems.
+    void sortByArchetype()
+    {
+        auto& table = CMTable::getSingleton()->getTable();
+        bool dirty = false;
+        for (auto& p : table) {
+            if (!p.second->isSorted())
+                dirty = true;
+        }
+        if (!dirty)
+            return;
+
+        map<ComponentMask, size_t> lookup;
+        _archetypes.clear();
+        for (const Entity& e : _entities)
+        {
+            if (e.components == 0)
+                continue;
+
+            auto it = lookup.find(e.components);
+            if (it == lookup.end()) {
+                it = lookup.emplace(e.components, _archetypes.size()).first;
+                _archetypes.push_back(Archetype{ e.components, {} });
+            }
+            _archetypes[it->second].entities.push_back(e.handle);
+        }
+
+        for (auto& p : table) {
+            p.second->sort(_archetypes);
+        }
+    }
+
+    // Notes that the entity table has changed, for takeChanged(). Whatever
+    // changes an Entity outside of EntityManager calls it. Thread safe.
+    void markChanged()
+    {
+        if (!_changed.load(memory_order_relaxed))
+            _changed = true;
+    }
+
+    // for the replay log: whether writeSnapshot()'s output may have changed
+    // since the last call
+    bool takeChanged()
+    {
+        return _changed.exchange(false);
+    }
+
+    const vector<Archetype>& getArchetypes() const
+    {
+        return _archetypes;
+    }
+
+    // Calls fn(n, Ts*...) once per archetype that has all of Ts, passing
+    // that archetype's column from each ComponentManager; row i of every
+    // column belongs to the same entity. All of Ts must be sorted. Columns
+    // of a const T are only read.
+    template<typename... Ts, typename Fn>
+    void eachArchetype(Fn fn)
+    {
+        ComponentMask query = 0;
+        (void)initializer_list<int>{ (query |= componentBit(Ts::id), 0)... };
+        (void)initializer_list<int>{ (assert(poolOf<Ts>()->isSorted()), 0)... };
+
+        for (size_t a = 0; a < _archetypes.size(); ++a)
+        {
+            if ((_archetypes[a].mask & query) == query)
+                fn(_archetypes[a].entities.size(), poolOf<Ts>()->column(a, _archetypes[a].entities.size())...);
+        }
+    }
+
+    // hash of the entity table and free list; see World::stateHash()
+    uint64_t stateHash() const
+    {
+        uint64_t sum = 0;
+        for (const Entity& e : _entities)
+        {
+            uint64_t fields[2] = { e.handle.raw, (uint64_t(e.components) << 32) | (uint64_t(e.prefabParent) << 8) | e.valid };
+            sum += hashBytes(fields, sizeof(fields), 0);
+        }
+        for (const auto& pf : _prefabs)
+        {
+            uint64_t fields[2] = { pf->handle, (uint64_t(pf->shared) << 32) | pf->copied };
+            sum = mix64(sum ^ hashBytes(fields, sizeof(fields), 2));
+        }
+        return mix64(sum) ^ hashBytes(_freeList.data(), _freeList.size() * sizeof(uint32_t), 1);
+    }
+
+    // Entity table, free list and prefabs, for World snapshots. Entities
+    // marked for destruction should be destroyed first. Prefab components
+    // are in their pools' snapshots.
+    void writeSnapshot(vector<char>& out) const
+    {
+        writeBytes(out, static_cast<uint64_t>(_entities.size()));
+        writeBytes(out, static_cast<uint64_t>(_freeList.size()));
+        padBytes(out, CACHE_LINE_SIZE);
+        size_t at = out.size();
+        out.resize(at + _entities.size() * sizeof(EntityRecord));
+        for (size_t i = 0; i < _entities.size(); ++i)
+        {
+            const Entity& e = _entities[i];
+            EntityRecord record{};  // zeroes the padding too
+            record.handle = e.handle;
+            record.components = e.components;
+            record.prefabParent = e.prefabParent;
+            record.valid = e.valid;
+            memcpy(&out[at + i * sizeof(EntityRecord)], &record, sizeof(record));
+        }
+        padBytes(out, CACHE_LINE_SIZE);
+        writeBytes(out, _freeList.data(), _freeList.size());
+        padBytes(out, CACHE_LINE_SIZE);
+
+        writeBytes(out, static_cast<uint32_t>(_prefabs.size()));
+        for (const auto& pf : _prefabs)
+        {
+            writeBytes(out, static_cast<uint32_t>(pf->name.size()));
+            writeBytes(out, pf->name.data(), pf->name.size());
+            writeBytes(out, pf->shared);
+            writeBytes(out, pf->copied);
+            for (auto& p : pf->components)
+                writeBytes(out, p.second);
+        }
+        padBytes(out, CACHE_LINE_SIZE);
+    }
+
+    void readSnapshot(const char*& in)
+    {
+        uint64_t count, free;
+        readBytes(in, count);
+        readBytes(in, free);
+        alignPointer(in, CACHE_LINE_SIZE);
+
+        markChanged();
         _entities.clear();
+        _entities.reserve(count);
+        const EntityRecord* records = reinterpret_cast<const EntityRecord*>(in);
+        for (uint64_t i = 0; i < count; ++i)
+        {
+            EntityHandle h = records[i].handle;
+            _entities.emplace_back(h, records[i].prefabParent);
+            _entities.back().components = records[i].components;
+            _entities.back().valid = records[i].valid != 0;
+        }
+        in += count * sizeof(EntityRecord);
+        alignPointer(in, CACHE_LINE_SIZE);
+
+        const uint32_t* src = reinterpret_cast<const uint32_t*>(in);
+        _freeList.assign(src, src + free);
+        in += free * sizeof(uint32_t);
+        alignPointer(in, CACHE_LINE_SIZE);
+
+        // components are listed in id order, as CompactMap keeps them
+        uint32_t prefabs;
+        readBytes(in, prefabs);
+        _prefabs.clear();
+        _prefabNames.clear();
+        for (uint32_t i = 0; i < prefabs; ++i)
+        {
+            uint32_t length;
+            readBytes(in, length);
+            Prefab* pf = makePrefab(string(in, length));
+            in += length;
+            readBytes(in, pf->shared);
+            readBytes(in, pf->copied);
+            for (uint8_t id = 0; id < 32; ++id)
+            {
+                if ((pf->shared | pf->copied) & componentBit(ComponentId(id))) {
+                    uint16_t idx;
+                    readBytes(in, idx);
+                    pf->components.add(ComponentId(id), idx);
+                }
+            }
+        }
+        alignPointer(in, CACHE_LINE_SIZE);
+
+        _archetypes.clear();
     }
 
+    // the prefab called name, made empty if there isn't one yet
     Prefab* makePrefab(const string& name)
     {
-        uint16_t idx = static_cast<uint16_t>(_prefabs.size());
-        _prefabs.emplace_back(idx);
-        _prefabNames[name] = idx;
-        return &_prefabs[idx];
+        if (Prefab* pf = getPrefab(name))
+            return pf;
+
+        markChanged();
+        uint16_t h = static_cast<uint16_t>(_prefabs.size() + 1);
+        _prefabs.emplace_back(new Prefab(h, name));
+        _prefabNames[name] = h;
+        return _prefabs.back().get();
+    }
+
+    Prefab* getPrefab(const string& name)
+    {
+        auto it = _prefabNames.find(name);
+        return it == _prefabNames.end() ? nullptr : getPrefab(it->second);
+    }
+
+    Prefab* getPrefab(uint16_t handle)
+    {
+        return handle > 0 && handle <= _prefabs.size() ? _prefabs[handle - 1].get() : nullptr;
     }
 
 
 private:
+    struct EntityRecord
+    {
+        EntityHandle handle;
+        ComponentMask components;
+        uint16_t prefabParent;
+        uint8_t valid;
+    };
+
     vector<Entity> _entities;
-    vector<Prefab> _prefabs;
+    vector<uint32_t> _freeList;
+    vector<Archetype> _archetypes;
+    vector<unique_ptr<Prefab>> _prefabs;   // by handle - 1
+    atomic<bool> _changed{true};
     map<string, uint16_t> _prefabNames;
 };
 
+template<typename T>
+T* Entity::addComponent()
+{
+    components |= componentBit(T::id);
+    EM->markChanged();
+    return CM(T)->addComponent(handle);
+}
+
+template<typename T>
+void Entity::removeComponent()
+{
+    components &= ~componentBit(T::id);
+    EM->markChanged();
+    CM(T)->removeComponent(handle);
+}
+
+inline ComponentMask Entity::allComponents() const
+{
+    const Prefab* pf = EM->getPrefab(prefabParent);
+    return pf ? components | pf->shared : components;
+}
+
+template<typename T>
+const T* Entity::getComponentRO() const
+{
+    if (const T* own = CM(T)->getComponentRO(handle))
+        return own;
+    const Prefab* pf = EM->getPrefab(prefabParent);
+    return pf ? pf->getComponentRO<T>() : nullptr;
+}
+
+template<typename T>
+T* Entity::getComponent()
+{
+    if (T* own = CM(T)->getComponent(handle))
+        return own;
+    Prefab* pf = EM->getPrefab(prefabParent);
+    if (!pf || !pf->hasComponent<T>())
+        return nullptr;
+
+    CM(T)->instantiate(&handle, 1, pf->components.get(T::id));
+    components |= componentBit(T::id);
+    EM->markChanged();
+    return CM(T)->getComponent(handle);
+}
+
+// Query over every entity that has all of Ts, yielding the components
+// themselves rather than entities:
+//
+//     view<PositionData, MovableData>().each([](PositionData& pd, MovableData& md) { ... });
+//
+// Ask for const T to only read T; only pools asked for without const are
+// marked as written for the replay log.
+//
+// When the ComponentManagers are sorted by archetype, matches come out as
+// contiguous spans (one per archetype); otherwise the smallest pool drives
+// the iteration and the others are probed through their sparse indices.
+template<typename... Ts>
+class View
+{
+public:
+    // fn(Ts&...) once per matching entity
+    template<typename Fn>
+    void each(Fn fn)
+    {
+        eachSpan([&](Span<Ts>... spans) {
+            size_t n = spanSize(spans...);
+            for (size_t i = 0; i < n; ++i)
+                fn(spans[i]...);
+        });
+    }
+
+    // fn(Span<Ts>...) once per contiguous block of matches; element i of
+    // every span belongs to the same entity
+    template<typename Fn>
+    void eachSpan(Fn fn)
+    {
+        if (sizeof...(Ts) == 1)
+        {
+            // a single pool is always one span
+            fn(Span<Ts>(poolOf<Ts>()->getData().data(), poolOf<Ts>()->size())...);
+            return;
+        }
+
+        bool sorted = true;
+        (void)initializer_list<int>{ (sorted = sorted && poolOf<Ts>()->isSorted(), 0)... };
+        if (sorted)
+        {
+            EM->eachArchetype<Ts...>([&](size_t n, Ts*... cols) {
+                fn(Span<Ts>(cols, n)...);
+            });
+            return;
+        }
+
+        size_t smallest = numeric_limits<size_t>::max();
+        const CMInterface* driver = nullptr;
+        (void)initializer_list<int>{ (poolOf<Ts>()->size() < smallest ? (smallest = poolOf<Ts>()->size(), driver = poolOf<Ts>(), 0) : 0)... };
+        (void)initializer_list<int>{ (driver == poolOf<Ts>() ? (eachDrivenBy<Ts>(fn), 0) : 0)... };
+    }
+
+    // upper bound on the number of matches
+    size_t sizeHint() const
+    {
+        size_t smallest = numeric_limits<size_t>::max();
+        (void)initializer_list<int>{ (smallest = std::min(smallest, poolOf<Ts>()->size()), 0)... };
+        return smallest;
+    }
+
+private:
+    template<typename D, typename Fn>
+    void eachDrivenBy(Fn& fn)
+    {
+        for (D& d : *poolOf<D>())
+        {
+            const EntityHandle& h = d.parent;
+            bool match = true;
+            (void)initializer_list<int>{ (match = match && poolOf<Ts>()->hasComponent(h), 0)... };
+            if (match)
+                fn(Span<Ts>(poolOf<Ts>()->getComponent(h), 1)...);
+        }
+    }
+
+    template<typename S, typename... Rest>
+    static size_t spanSize(const S& first, const Rest&...)
+    {
+        return first.size();
+    }
+};
+
+template<typename... Ts>
+View<Ts...> view()
+{
+    return View<Ts...>();
+}
+
 // 1 unit = 1 meter
 // The ideal chunk size depends on usage
 const static uint32_t CHUNK_SIZE = 250;
 
+// side of a spatial index cell; must divide CHUNK_SIZE
+const static uint32_t SPATIAL_CELL_SIZE = 25;
+const static uint32_t SPATIAL_CELLS_PER_CHUNK = CHUNK_SIZE / SPATIAL_CELL_SIZE;
+
+typedef SpatialGrid<EntityHandle, CHUNK_SIZE, SPATIAL_CELL_SIZE> ChunkSpatialGrid;
+
+// how far ahead of a moving entity to prefetch paged-out chunks
+const static int PREFETCH_DISTANCE = 32;
+
+// Terrain for one chunk. Stored run-length encoded while that is smaller,
+// so a uniform chunk is a single run, and as a dense matrix otherwise.
+class ChunkTerrain
+{
+public:
+    ChunkTerrain();
+
+    Terrain operator()(uint32_t x, uint32_t y) const;
+    void set(uint32_t x, uint32_t y, Terrain t);
+    void fill(Terrain t);
+
+    // switch to whichever representation is smaller
+    void optimize();
+
+    bool isCompressed() const { return !_dense; }
+    size_t memoryUsage() const;
+
+    void serialize(vector<char>& out) const;
+    void deserialize(const char*& in);
+
+    // calls fn(x0, x1, terrain) for each run of equal terrain in row y
+    template<typename Fn>
+    void forEachRun(uint32_t y, Fn fn) const
+    {
+        if (!_dense) {
+            _rle.forEachRun(y, fn);
+            return;
+        }
+
+        uint32_t x0 = 0;
+        for (uint32_t x = 1; x <= CHUNK_SIZE; ++x)
+        {
+            if (x == CHUNK_SIZE || (*_dense)(x, y) != (*_dense)(x0, y)) {
+                fn(x0, x, (*_dense)(x0, y));
+                x0 = x;
+            }
+        }
+    }
+
+private:
+    // past this many runs, RLE is no longer worth it
+    static const size_t MAX_RUNS = CHUNK_SIZE * CHUNK_SIZE * sizeof(Terrain) / (sizeof(Terrain) + sizeof(uint32_t)) / 2;
+
+    unique_ptr<Matrix<Terrain>> _dense;
+    RLEMatrix<Terrain> _rle;
+};
+
 struct WorldChunk
 {
     vector<EntityHandle> entities;
-    Matrix<Terrain> terrain;
-    BitsetMatrix<CHUNK_SIZE, CHUNK_SIZE> blocked; // TODO: write SparseMatrixBool
+    ChunkSpatialGrid spatial;
+    OccupancyMap<EntityHandle> occupancy; // keyed by cellIndex()
+    ChunkTerrain terrain;
+    SparseMatrixBool<CHUNK_SIZE, CHUNK_SIZE> blocked;
+    atomic<uint64_t> lastAccess{0}; // tick, for paging
+    bool terrainDirty = false;      // edited since the last replay log delta
 
-    WorldChunk() : terrain(CHUNK_SIZE, CHUNK_SIZE)
+    WorldChunk()
     {
     }
+
+    // terrain and blocked tiles, for paging and snapshots
+    void writeTiles(vector<char>& out) const;
+    void readTiles(const char*& in);
+
+    // bytes held by the chunk itself, not counting its entities' components
+    size_t memoryUsage() const
+    {
+        return sizeof(*this) + terrain.memoryUsage() + blocked.memoryUsage() +
+            entities.capacity() * sizeof(EntityHandle) +
+            (entities.size() * (sizeof(ChunkSpatialGrid::Entry) + 2 * 16));
+    }
+
+    // index of world cell (x, y) within its chunk
+    static uint32_t cellIndex(int x, int y)
+    {
+        return (y % CHUNK_SIZE) * CHUNK_SIZE + (x % CHUNK_SIZE);
+    }
+};
+
+struct PagingStats
+{
+    uint64_t pageOuts = 0;
+    uint64_t pageIns = 0;
+    uint64_t prefetches = 0;
+    uint64_t hits = 0;          // page-ins served from a finished prefetch
+    uint64_t misses = 0;        // page-ins that had to read synchronously
+    double stallSeconds = 0;    // time spent in those synchronous reads
+};
+
+struct PathfinderStats
+{
+    uint64_t requests = 0;
+    uint64_t direct = 0;        // solved by a plain search on the tile grid
+    uint64_t hierarchical = 0;  // solved over the portal graph
+    uint64_t failed = 0;
+    uint64_t graphsBuilt = 0;   // chunk graphs (re)built
+};
+
+struct FlowFieldStats
+{
+    size_t fields = 0;          // in use now
+    uint64_t fieldsBuilt = 0;
+    uint64_t chunksBuilt = 0;   // chunks' directions worked out, including rebuilds
+};
+
+// Structural changes recorded by systems while they run: creating and
+// destroying entities, adding and removing components, and moves. Each
+// worker records into its own buffer (World::commands()), so recording
+// takes no locks; World::applyCommands() plays them all back once the
+// systems are done.
+//
+// Playback goes by target entity, then kind of command, in the order
+// Create, Add, Remove, Move, Destroy, then by contents, so the result
+// doesn't depend on which thread recorded what. A command for an entity
+// that has been destroyed or marked for it by then is dropped, and so is
+// one that adds or removes components of an entity whose components are
+// paged out: restoring them would undo it.
+class CommandBuffer
+{
+public:
+    // A new entity at (x, y) with copies of components. source is whoever
+    // asked for it; it only decides where the new entity goes in the
+    // order.
+    template<typename... Ts>
+    void create(const EntityHandle& source, int x, int y, const Ts&... components)
+    {
+        size_t offset = _data.size();
+        writeBytes(_data, static_cast<uint32_t>(sizeof...(Ts)));
+        (void)initializer_list<int>{ (writeComponent(components), 0)... };
+        push(Kind::Create, source, ComponentId::None, x, y, offset);
+    }
+
+    template<typename T>
+    void add(const EntityHandle& h, const T& component)
+    {
+        size_t offset = _data.size();
+        writeBytes(_data, uint32_t(1));
+        writeComponent(component);
+        push(Kind::Add, h, T::id, 0, 0, offset);
+    }
+
+    template<typename T>
+    void remove(const EntityHandle& h)
+    {
+        static_assert(!is_same<T, PositionData>::value, "destroy() the entity instead");
+        push(Kind::Remove, h, T::id, 0, 0, _data.size());
+    }
+
+    // to (x, y), if the tile is still free then
+    void move(const EntityHandle& h, int x, int y)
+    {
+        push(Kind::Move, h, ComponentId::None, x, y, _data.size());
+    }
+
+    // The entity stops being valid right away, so systems that run later
+    // in the tick skip it. Stale handles are ignored; the slot may belong
+    // to another entity by now.
+    void destroy(const EntityHandle& h)
+    {
+        if (!EM->isValid(h))
+            return;
+        EM->getEntity(h)->valid = false;
+        EM->markChanged();
+        push(Kind::Destroy, h, ComponentId::None, 0, 0, _data.size());
+    }
+
+    size_t size() const { return _commands.size(); }
+
+private:
+    friend class World;
+
+    enum class Kind : uint8_t
+    {
+        Create,
+        Add,
+        Remove,
+        Move,
+        Destroy,
+    };
+
+    struct Command
+    {
+        EntityHandle target;
+        Kind kind;
+        ComponentId component;
+        int32_t x;
+        int32_t y;
+        uint32_t offset;    // component data in _data
+        uint32_t size;
+    };
+
+    template<typename T>
+    void writeComponent(const T& c)
+    {
+        static_assert(!is_same<T, PositionData>::value, "positions go through create() and move()");
+        writeBytes(_data, T::id);
+        ComponentIO<T>::write(_data, c);
+    }
+
+    void push(Kind kind, const EntityHandle& target, ComponentId component, int x, int y, size_t offset)
+    {
+        uint32_t size = static_cast<uint32_t>(_data.size() - offset);
+        _commands.push_back(Command{ target, kind, component, x, y, static_cast<uint32_t>(offset), size });
+    }
+
+    void clear()
+    {
+        _commands.clear();
+        _data.clear();
+    }
+
+    vector<Command> _commands;
+    vector<char> _data;
 };
 
+// Fills in a newly created chunk; cx, cy are chunk coordinates. May be
+// called from several threads at once, for different chunks.
+typedef function<void(WorldChunk& chunk, uint32_t cx, uint32_t cy)> ChunkGenerator;
+
+// Whether an entity being spawned by World::spawnBatch() may go on world
+// tile (x, y) of chunk. Called from several threads at once, for
+// different chunks.
+typedef function<bool(const WorldChunk& chunk, int x, int y)> Placement;
+
 class World
 {
 public:
-    World(uint32_t width, uint32_t height);
+    World(uint32_t width, uint32_t height, ChunkGenerator generator=nullptr);
+    ~World();
 
+    // Chunks are created by the generator the first time they're accessed.
+    // findChunk() doesn't create them, and returns nullptr instead.
     WorldChunk& chunkAt(int x, int y);
-    Terrain& at(int x, int y);
+    WorldChunk* findChunk(int x, int y);
+    size_t getNumMaterialized() const;
+
+    uint32_t chunkIndex(int x, int y) const;
+    uint32_t getNumChunks() const;
+    Terrain at(int x, int y);
+    void setTerrain(int x, int y, Terrain t);
+
+    // bumped whenever a tile in chunk idx becomes a wall or stops being
+    // one, so whatever is cached from the walls knows to rebuild
+    uint32_t getWallVersion(uint32_t idx) const { return _wallVersions[idx]; }
     uint32_t getWidth() const;
     uint32_t getHeight() const;
     void addEntity(Entity* e);
-    void move(Entity* e, int x, int y);
-    bool tryMove(Entity* e, int x, int y);
+    void removeEntity(const EntityHandle& h);
+
+    // Spawns count entities from pf, which must copy PositionData, spread
+    // evenly over the world's chunks and each put on a random tile of its
+    // chunk that place accepts. Chunks are filled in parallel, each from
+    // its own generator seeded from seed, so where things land doesn't
+    // depend on the number of workers. Only the chunks that get entities
+    // are created or paged in. If some chunks run out of room, what didn't
+    // fit is destroyed again and it throws, naming them all; what did fit
+    // stays.
+    void spawnBatch(const Prefab& pf, size_t count, uint64_t seed, const Placement& place);
+    void move(PositionData& pd, int x, int y);
+    bool tryMove(PositionData& pd, int x, int y);
+
+    // The calling worker's command buffer; see CommandBuffer. Game::tick
+    // applies them after the systems have run.
+    CommandBuffer& commands() { return _commandBuffers[JobSystem::currentWorker()]; }
+    void applyCommands();
+    // one buffer per worker, in case the pool was restarted with more;
+    // Game::tick calls it before the systems run
+    void growCommandBuffers();
     vector<EntityHandle> getEntitiesAt(int x, int y);
+
+    // calls fn(handle) for each entity at (x, y), without allocating
+    template<typename Fn>
+    void forEachEntityAt(int x, int y, Fn fn)
+    {
+        WorldChunk* chunk = findChunk(x, y);
+        if (chunk)
+            chunk->occupancy.forEach(WorldChunk::cellIndex(x, y), fn);
+    }
+
     bool getBlocked(int x, int y);
     void setBlocked(int x, int y, bool val);
     EntityHandle findNearestPlant(const Position& src);
 
+    // Spatial queries. These search outward ring by ring over the spatial
+    // index cells, across chunk borders, and only consider entities that
+    // have every component in required, their own or their prefab's.
+    size_t findKNearest(const Position& src, size_t k, uint32_t maxRadius, ComponentMask required,
+        vector<EntityHandle>& out);
+    EntityHandle findNearest(const Position& src, uint32_t maxRadius, ComponentMask required);
+
+    // findKNearest with its result in the calling worker's FrameArena, so
+    // it doesn't touch the heap; the span is only good until the end of
+    // the tick.
+    Span<EntityHandle> findKNearestFrame(const Position& src, size_t k, uint32_t maxRadius, ComponentMask required);
+
     void inspect();
 
     void populate();
 
+    // Binary snapshot of the whole simulation: entities, every component
+    // pool and all generated chunks. Loading maps the file and copies
+    // plain-data pools straight out of it. Call between ticks; chunks that
+    // were never generated are left to the generator, so pass the same one.
+    void saveSnapshot(const string& path);
+    static shared_ptr<World> loadSnapshot(const string& path, ChunkGenerator generator=nullptr);
+    uint64_t getTick() const { return _tick; }
+
+    // Advances the world clock. Game::tick calls it between ticks.
+    void setTick(uint64_t tick) { _tick = tick; }
+
+    // Hash of the simulation state: the tick, entities and every component.
+    // Two runs that agree on it every tick have done the same thing, so
+    // comparing per-tick hashes finds the first tick where they diverged.
+    uint64_t stateHash();
+
+    // For forked checkpoints: finish in-flight page reads so no lock is
+    // held across fork(), and give the child its own page file descriptor
+    // so its reads don't move the parent's file offset.
+    void prepareForFork();
+    void reopenPageFile();
+
+    // Rebuild the world as of tick from a base snapshot and the replay log
+    // recorded on top of it (see ReplayRecorder), or as of the end of the
+    // log if it stops earlier. getTick() says which.
+    static shared_ptr<World> replay(const string& snapshotPath, const string& logPath, uint64_t tick,
+        ChunkGenerator generator=nullptr);
+    void recordTerrainChanges(vector<char>& out, uint32_t& entries);
+
+    // Chunk paging. With a memory budget set, chunks that haven't been
+    // touched for a while are written to the page file along with their
+    // entities' components, and read back when something accesses them.
+    // Paged-out entities stay alive but have no components, so systems and
+    // queries don't see them until their chunk returns.
+    void setMemoryBudget(size_t bytes);
+    void setPageFile(const string& path);
+    void prefetch(int x, int y);
+    void updatePaging(uint64_t tick);
+    const PagingStats& getPagingStats() const { return _pagingStats; }
+
+    // whether there's a memory budget, or any chunk is paged out
+    bool isPaging() const;
+
 private:
+    enum class PageState : uint8_t
+    {
+        Resident,
+        PagedOut,
+        Loading,
+        Loaded,
+    };
+
+    struct ChunkPage
+    {
+        PageState state = PageState::Resident;
+        uint64_t offset = 0;
+        uint32_t size = 0;
+        uint32_t capacity = 0;
+        vector<char> data;  // filled in by a finished prefetch
+    };
+
+    const ChunkSpatialGrid::Entry* spatialCell(int gx, int gy, size_t& count);
+    WorldChunk& materializeChunk(uint32_t idx);
+    WorldChunk& loadChunk(uint32_t idx);
+
+    void touch(WorldChunk& chunk)
+    {
+        if (chunk.lastAccess.load(memory_order_relaxed) != _tick)
+            chunk.lastAccess.store(_tick, memory_order_relaxed);
+    }
+
+    size_t residentMemory();
+    void pageOut(uint32_t idx);
+    WorldChunk& installChunk(uint32_t idx, vector<char> bytes);
+    static WorldChunk* chunkFromPage(const char* page);
+    void restoreComponents(const char* page);
+    vector<char> pageBytes(ChunkPage& page);
+    vector<char> readPage(const ChunkPage& page);
+    void writePage(ChunkPage& page, const vector<char>& bytes);
+
     uint32_t _width;
     uint32_t _height;
-    Matrix<WorldChunk> _chunks;
+    uint32_t _chunksX;
+    uint32_t _chunksY;
+    unique_ptr<atomic<WorldChunk*>[]> _chunks;
+    vector<uint32_t> _wallVersions;
+    ChunkGenerator _generator;
+
+    uint64_t _tick = 0;
+    size_t _memoryBudget = 0;
+    map<uint32_t, ChunkPage> _pages;    // chunks that have been paged out at least once
+    typedef pair<uint32_t, vector<char>> PendingRestore;    // chunk index, page
+    vector<PendingRestore> _pendingRestore;
+    mutex _pageMtx;
+    string _pagePath = "wsim.pages";
+    fstream _pageFile;
+    uint64_t _pageFileEnd = 0;
+    mutex _fileMtx;
+    JobGroup _prefetchJobs;
+
+    vector<CommandBuffer> _commandBuffers;  // one per worker
+    PagingStats _pagingStats;
 };
 
 class System;
+class Scheduler;
+class TimingWheel;
+class Pathfinder;
+class FlowFields;
+
+// tick durations, in seconds
+struct TickStats
+{
+    uint64_t count = 0;
+    double total = 0;
+    double totalSq = 0;
+    double max = 0;
+
+    void add(double seconds)
+    {
+        count++;
+        total += seconds;
+        totalSq += seconds * seconds;
+        max = std::max(max, seconds);
+    }
+
+    double mean() const { return count ? total / count : 0; }
+    double stddev() const { return count ? sqrt(std::max(0.0, totalSq / count - mean() * mean())) : 0; }
+};
+
+struct CheckpointStats
+{
+    uint64_t started = 0;
+    uint64_t written = 0;
+    uint64_t failed = 0;
+    uint64_t skipped = 0;       // previous one still being written
+    double forkSeconds = 0;     // last time the tick loop spent starting one
+    double writeSeconds = 0;    // last time from start until it was on disk
+    TickStats ticksIdle;        // ticks with no checkpoint in flight
+    TickStats ticksDuring;      // ticks while one was being written
+};
+
+struct ReplayStats
+{
+    uint64_t ticks = 0;
+    uint64_t bytes = 0;         // log size, excluding the base snapshot
+    double seconds = 0;         // time spent recording
+};
+
+// Writes a base snapshot, then appends one delta per tick to a log: the
+// words of the entity table and each component pool that changed since
+// the previous tick, and the terrain of chunks that were edited. Pools and
+// the entity table say what was written during the tick, so only that is
+// compared, and a quiet tick costs next to nothing.
+// Chunk entity lists and blocked tiles aren't logged; replay rebuilds them
+// from positions. Paged-out components aren't in the pools, so recording
+// refuses to run while paging is on (see World::isPaging()).
+class ReplayRecorder
+{
+public:
+    ReplayRecorder(shared_ptr<World> world, const string& snapshotPath, const string& logPath);
+
+    // call between ticks, after the world's tick has advanced
+    void record(uint64_t tick);
+    const ReplayStats& getStats() const { return _stats; }
+
+private:
+    void diff(uint32_t id, const vector<char>& now);
+    void diffChanges(uint32_t id, CMInterface* cm);
+    size_t beginEntry(uint32_t id);
+    void endEntry(size_t entryAt, bool resized);
+    void addWord(size_t i, uint64_t word);
+    void flushRun();
+
+    shared_ptr<World> _world;
+    ofstream _log;
+    map<uint32_t, vector<char>> _sections;  // as of the last logged tick
+    vector<char> _scratch;
+    vector<uint64_t> _run;      // changed words not written out yet
+    size_t _runStart = 0;       // word index of the first of them
+    size_t _runLast = 0;        // end of the last run in this entry
+    vector<char> _record;
+    uint32_t _entries = 0;
+    ReplayStats _stats;
+};
 
 class Game
 {
@@ -332,8 +1724,53 @@ public:
 
     void tick();
 
+    // Snapshot the world as of now, between ticks, and write it to path in
+    // the background while ticking carries on. On POSIX the snapshot is
+    // written by a fork()ed child, so the copy is the kernel's
+    // copy-on-write; elsewhere it's written synchronously. Returns false
+    // if the previous checkpoint is still being written.
+    bool checkpoint(const string& path);
+    bool isCheckpointing() const { return _checkpointPid != 0; }
+    void waitForCheckpoint();
+
+    // checkpoint to path every interval ticks; 0 turns it off
+    void setAutoCheckpoint(const string& path, uint64_t interval);
+    const CheckpointStats& getCheckpointStats() const { return _checkpointStats; }
+
+    // Record World::stateHash() after every tick. The simulation is
+    // deterministic whatever the thread count; this is how to check.
+    void setStateHashing(bool enabled);
+    uint64_t getStateHash() const { return _hashes.empty() ? 0 : _hashes.back(); }
+    const vector<uint64_t>& getHashHistory() const { return _hashes; }
+
+    // log every tick from now on; see ReplayRecorder
+    void startRecording(const string& snapshotPath, const string& logPath);
+    void stopRecording();
+    const ReplayRecorder* getRecorder() const { return _recorder.get(); }
+
+    // wakeups waiting in the systems' timing wheels
+    size_t getPendingWakeups() const;
+
+    PathfinderStats getPathfinderStats() const;
+    FlowFieldStats getFlowFieldStats() const;
+
 private:
+    void pollCheckpoint(bool block);
+
     uint64_t _time; // absolute world time, in milliseconds
     shared_ptr<World> _world;
     vector<unique_ptr<System>> _systems;
+    unique_ptr<Scheduler> _scheduler;
+    vector<unique_ptr<TimingWheel>> _timers;
+    unique_ptr<Pathfinder> _pathfinder;
+    unique_ptr<FlowFields> _flowFields;
+
+    long _checkpointPid = 0;
+    high_resolution_clock::time_point _checkpointStart;
+    string _checkpointPath;
+    uint64_t _checkpointInterval = 0;
+    CheckpointStats _checkpointStats;
+    unique_ptr<ReplayRecorder> _recorder;
+    bool _stateHashing = false;
+    vector<uint64_t> _hashes;
 };